@@ -7,6 +7,8 @@
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/CommandLine.h"
 
+#include "TraversalPolicy.h"
+
 namespace ct = clang::tooling;
 
 class MyAstVisitor : public clang::RecursiveASTVisitor<MyAstVisitor> {
@@ -46,9 +48,9 @@ void MyAstVisitor::printStack() const {
 class MyAstConsumer : public clang::ASTConsumer {
  public:
   void HandleTranslationUnit(clang::ASTContext& astContext) final {
-    clang::TranslationUnitDecl* tuDecl = astContext.getTranslationUnitDecl();
+    // records are only printed for the main file, so the subtrees of the headers are not walked
     MyAstVisitor astVisitor(astContext);
-    astVisitor.TraverseDecl(tuDecl);
+    TraversalPolicy(astContext.getSourceManager()).traverse(astVisitor, astContext);
   }
 };
 
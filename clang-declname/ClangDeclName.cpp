@@ -23,6 +23,8 @@
 #include "clang/Rewrite/Frontend/Rewriters.h"
 #include "llvm/Support/Host.h"
 
+#include "CompilerSession.h"
+
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
@@ -46,32 +48,26 @@ public:
 };
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    llvm::errs() << "usage: " << argv[0] << " <input-file>\n";
+  if (argc < 2) {
+    llvm::errs() << "usage: " << argv[0] << " <input-file>...\n";
     return 1;
   }
 
-  CompilerInstance ci;
-  ci.createDiagnostics();
-
-  auto to = std::make_shared<TargetOptions>();
-  to->Triple = llvm::sys::getDefaultTargetTriple();
-  TargetInfo *targetInfo = TargetInfo::CreateTargetInfo(ci.getDiagnostics(), to);
-  ci.setTarget(targetInfo);
+  // diagnostics, target and file manager are set up once for all the input files
+  CompilerSession session;
 
-  ci.createFileManager();
-  ci.createSourceManager(ci.getFileManager());
-  ci.createPreprocessor(TU_Complete);
-  ci.createASTContext();
-  ci.setASTConsumer(std::make_unique<CustomASTConsumer>());
-  
-  llvm::ErrorOr<const clang::FileEntry*> pFile = ci.getFileManager().getFile(argv[1]);
-  SourceManager &SourceMgr = ci.getSourceManager();
-  SourceMgr.setMainFileID(SourceMgr.createFileID(pFile.get(), SourceLocation(), SrcMgr::C_User));
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    // fresh SourceManager, Preprocessor and ASTContext
+    if (!session.begin(argv[i], /*Parse=*/true)) {
+      status = 1;
+      continue;
+    }
 
-  ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(), &ci.getPreprocessor());
-  clang::ParseAST(ci.getPreprocessor(), &ci.getASTConsumer(), ci.getASTContext());
-  ci.getDiagnosticClient().EndSourceFile();
+    CustomASTConsumer consumer;
+    clang::ParseAST(session.getPreprocessor(), &consumer, session.getASTContext());
+    session.end();
+  }
 
-  return 0;
+  return status;
 }
\ No newline at end of file
@@ -25,6 +25,9 @@
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Lex/PreprocessorOptions.h"
 
+#include "CompilerSession.h"
+#include "HeaderSearchCache.h"
+
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
@@ -49,45 +52,45 @@ public:
 };
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    llvm::errs() << "usage: " << argv[0] << " <input-file>\n";
+  if (argc < 2) {
+    llvm::errs() << "usage: " << argv[0] << " <input-file>...\n";
     return 1;
   }
 
-  CompilerInstance ci;
-  ci.createDiagnostics();
-
-  auto to = std::make_shared<TargetOptions>();
-  to->Triple = llvm::sys::getDefaultTargetTriple();
-  TargetInfo *targetInfo = TargetInfo::CreateTargetInfo(ci.getDiagnostics(), to);
-  ci.setTarget(targetInfo);
+  // diagnostics, target and file manager are set up once for all the input files
+  CompilerSession session;
 
-  ci.createFileManager();
-  ci.createSourceManager(ci.getFileManager());
- 
   // set up HeaderSearchOptions
-  HeaderSearchOptions &hso = ci.getHeaderSearchOpts();
+  HeaderSearchOptions &hso = session.getHeaderSearchOpts();
 
-  // add the system include path
-  hso.AddPath("/usr/include", System, false, false);
-  hso.AddPath("/usr/local/include", System, false, false);
-  hso.AddPath("/usr/local/lib/gcc/x86_64-pc-linux-gnu/7.5.0/include", System, false, false);
+  // add the system include paths of the host compiler, which is only queried again when it changes
+  std::vector<std::string> systemDirs = hostIncludePaths();
+  if (systemDirs.empty()) {
+    systemDirs = {"/usr/local/include", "/usr/include"};
+  }
+  for (const std::string &dir : systemDirs) {
+    hso.AddPath(dir, System, false, false);
+  }
 
   // add the current directory as a user include path
   hso.AddPath(".", Angled, false, false);
 
-  ci.createPreprocessor(TU_Complete);
+  // include lookups that failed in earlier runs are not tried again while their directory is unchanged
+  session.getInstance().getFileManager().setStatCache(
+      std::make_unique<PersistentStatCache>(userCacheFile("missing-headers")));
 
-  ci.createASTContext();
-  ci.setASTConsumer(std::make_unique<CustomASTConsumer>());
-  
-  llvm::ErrorOr<const clang::FileEntry*> pFile = ci.getFileManager().getFile(argv[1]);
-  SourceManager &SourceMgr = ci.getSourceManager();
-  SourceMgr.setMainFileID(SourceMgr.createFileID(pFile.get(), SourceLocation(), SrcMgr::C_User));
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    // fresh SourceManager, Preprocessor and ASTContext
+    if (!session.begin(argv[i], /*Parse=*/true)) {
+      status = 1;
+      continue;
+    }
 
-  ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(), &ci.getPreprocessor());
-  clang::ParseAST(ci.getPreprocessor(), &ci.getASTConsumer(), ci.getASTContext());
-  ci.getDiagnosticClient().EndSourceFile();
+    CustomASTConsumer consumer;
+    clang::ParseAST(session.getPreprocessor(), &consumer, session.getASTContext());
+    session.end();
+  }
 
-  return 0;
+  return status;
 }
\ No newline at end of file
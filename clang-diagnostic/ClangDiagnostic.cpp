@@ -1,4 +1,7 @@
+#include <array>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Basic/SourceLocation.h"
@@ -7,15 +10,21 @@
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
 
-namespace ct = clang::tooling;
+#include "IncrementalCache.h"
+#include "PchCache.h"
 
-std::string locationToString(const clang::SourceManager& sourceManager, clang::SourceLocation sourceLoc) {
-  return std::string(sourceManager.getFilename(sourceLoc)) + ":" +
-         std::to_string(sourceManager.getSpellingLineNumber(sourceLoc)) + ":" +
-         std::to_string(sourceManager.getSpellingColumnNumber(sourceLoc));
-}
+namespace ct = clang::tooling;
 
 std::string levelToString(clang::DiagnosticsEngine::Level level) {
   const std::map<clang::DiagnosticsEngine::Level, std::string> lut{
@@ -26,27 +35,350 @@ std::string levelToString(clang::DiagnosticsEngine::Level level) {
   return i != lut.end() ? i->second : "unknown";
 }
 
-class MyDiagnosticConsumer : public clang::DiagnosticConsumer {
+enum class OutputFormat { Text, JSONL, SARIF };
+
+static llvm::cl::OptionCategory toolOptions("Tool Options");
+static llvm::cl::opt<std::string> pchCacheDir("pch-cache",
+                                              llvm::cl::desc("Reuse precompiled preambles kept in this directory"),
+                                              llvm::cl::value_desc("dir"), llvm::cl::cat(toolOptions));
+static llvm::cl::opt<std::string> incrementalDir("incremental",
+                                                 llvm::cl::desc("Reuse the diagnostics of TUs whose files did not change"),
+                                                 llvm::cl::value_desc("dir"), llvm::cl::cat(toolOptions));
+static llvm::cl::opt<OutputFormat> format(
+    "format", llvm::cl::desc("Output format"), llvm::cl::init(OutputFormat::Text),
+    llvm::cl::values(clEnumValN(OutputFormat::Text, "text", "\"error at file:line:column\" lines on stderr"),
+                     clEnumValN(OutputFormat::JSONL, "jsonl", "one JSON object per diagnostic on stdout"),
+                     clEnumValN(OutputFormat::SARIF, "sarif", "a SARIF 2.1.0 log on stdout")),
+    llvm::cl::cat(toolOptions));
+static llvm::cl::opt<unsigned> jobs("j", llvm::cl::desc("Number of TUs processed at once, 0 for all cores"),
+                                    llvm::cl::init(1), llvm::cl::cat(toolOptions));
+
+// An error as reported, independent of the TU it came from. The file is empty for errors without a location.
+struct Diag {
+  std::string level;
+  std::string file;
+  unsigned offset = 0;
+  unsigned line = 0;
+  unsigned column = 0;
+  unsigned id = 0;
+  std::string message;
+};
+
+// A Diag as one line of JSON, the jsonl format and the form kept by the incremental mode.
+std::string toJsonLine(const Diag& diag) {
+  std::string line;
+  llvm::raw_string_ostream os(line);
+  llvm::json::OStream j(os);
+  j.object([&] {
+    j.attribute("level", diag.level);
+    if (!diag.file.empty()) {
+      j.attribute("file", diag.file);
+      j.attribute("line", diag.line);
+      j.attribute("column", diag.column);
+      j.attribute("offset", diag.offset);
+    }
+    j.attribute("id", diag.id);
+    j.attribute("message", diag.message);
+  });
+  os << '\n';
+  return os.str();
+}
+
+bool fromJsonLine(llvm::StringRef line, Diag& diag) {
+  llvm::Expected<llvm::json::Value> value = llvm::json::parse(line);
+  if (!value) {
+    llvm::consumeError(value.takeError());
+    return false;
+  }
+  const llvm::json::Object* object = value->getAsObject();
+  if (!object) {
+    return false;
+  }
+  auto string = [&](llvm::StringRef key, std::string& field) {
+    if (llvm::Optional<llvm::StringRef> s = object->getString(key)) {
+      field = s->str();
+    }
+  };
+  auto number = [&](llvm::StringRef key, unsigned& field) {
+    if (llvm::Optional<int64_t> n = object->getInteger(key)) {
+      field = static_cast<unsigned>(*n);
+    }
+  };
+  string("level", diag.level);
+  string("file", diag.file);
+  number("line", diag.line);
+  number("column", diag.column);
+  number("offset", diag.offset);
+  number("id", diag.id);
+  string("message", diag.message);
+  return true;
+}
+
+// The located diagnostics already reported, by file, offset and diagnostic id, shared by the TUs running in parallel.
+// The keys are spread over shards with a lock each, so TUs reporting at the same time rarely wait on each other.
+class DiagnosticSet {
  public:
-  MyDiagnosticConsumer() : errCount_(0) {}
-  void HandleDiagnostic(clang::DiagnosticsEngine::Level diagLevel, const clang::Diagnostic& info) override {
-    clang::SourceManager* sm = info.hasSourceManager() ? &info.getSourceManager() : nullptr;
-    if (diagLevel == clang::DiagnosticsEngine::Level::Error || diagLevel == clang::DiagnosticsEngine::Level::Fatal) {
-      if (sm) {
-        llvm::errs() << levelToString(diagLevel) << " at " << locationToString(*sm, info.getLocation()) << "\n";
-        ++errCount_;
+  // true the first time the key is seen
+  bool insert(const Diag& diag) {
+    std::string key = diag.file + '\0' + std::to_string(diag.offset) + '\0' + std::to_string(diag.id);
+    Shard& shard = shards_[llvm::xxHash64(key) % shards_.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.keys.insert(key).second;
+  }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    llvm::StringSet<> keys;
+  };
+  std::array<Shard, 64> shards_;
+};
+
+// Streams the diagnostics in the selected format as they are reported, from any thread. A diagnostic of a header is
+// reported once, whatever the number of TUs including it.
+class DiagnosticWriter {
+ public:
+  DiagnosticWriter() : out_(format == OutputFormat::Text ? llvm::errs() : llvm::outs()) {
+    if (format == OutputFormat::SARIF) {
+      out_ << R"({"version":"2.1.0","$schema":"https://json.schemastore.org/sarif-2.1.0.json",)"
+           << R"("runs":[{"tool":{"driver":{"name":"clang-diagnostic"}},"results":[)" << '\n';
+    }
+  }
+
+  void report(const Diag& diag) {
+    if (!diag.file.empty() && !seen_.insert(diag)) {
+      return;
+    }
+    std::string text = format == OutputFormat::Text ? toText(diag)
+                       : format == OutputFormat::JSONL ? toJsonLine(diag)
+                                                       : toSarif(diag);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (format == OutputFormat::SARIF && results_) {
+      out_ << ',';
+    }
+    out_ << text;
+    ++results_;
+    if (!diag.file.empty()) {
+      ++errCount_;
+    }
+  }
+
+  void finish() {
+    if (format == OutputFormat::SARIF) {
+      out_ << "]}]}\n";
+    }
+    out_.flush();
+  }
+
+  // located errors reported, duplicates left out
+  unsigned long getErrCount() const { return errCount_; }
+
+ private:
+  static std::string toText(const Diag& diag) {
+    if (diag.file.empty()) {
+      return diag.level + "\n";
+    }
+    return diag.level + " at " + diag.file + ":" + std::to_string(diag.line) + ":" + std::to_string(diag.column) + "\n";
+  }
+
+  // a file:// URI for path, every byte but the unreserved ones and the separators percent-encoded
+  static std::string fileUri(llvm::StringRef path) {
+    llvm::SmallString<256> absolute(path);
+    llvm::sys::fs::make_absolute(absolute);
+    llvm::sys::path::native(absolute, llvm::sys::path::Style::posix);
+    std::string uri = "file://";
+    if (!llvm::StringRef(absolute).startswith("/")) {
+      uri += '/';  // a drive letter
+    }
+    for (unsigned char c : absolute) {
+      if (llvm::isAlnum(c) || c == '/' || c == '-' || c == '.' || c == '_' || c == '~') {
+        uri += c;
       } else {
-        llvm::errs() << levelToString(diagLevel) << "\n";
+        uri += '%';
+        uri += llvm::hexdigit(c >> 4);
+        uri += llvm::hexdigit(c & 15);
       }
     }
+    return uri;
+  }
+
+  static std::string toSarif(const Diag& diag) {
+    std::string result;
+    llvm::raw_string_ostream os(result);
+    llvm::json::OStream j(os);
+    j.object([&] {
+      j.attribute("ruleId", std::to_string(diag.id));
+      j.attribute("level", "error");
+      j.attributeObject("message", [&] { j.attribute("text", diag.message); });
+      if (!diag.file.empty()) {
+        j.attributeArray("locations", [&] {
+          j.object([&] {
+            j.attributeObject("physicalLocation", [&] {
+              j.attributeObject("artifactLocation", [&] { j.attribute("uri", fileUri(diag.file)); });
+              j.attributeObject("region", [&] {
+                j.attribute("startLine", diag.line);
+                j.attribute("startColumn", diag.column);
+                j.attribute("charOffset", diag.offset);
+              });
+            });
+          });
+        });
+      }
+    });
+    os << '\n';
+    return os.str();
+  }
+
+  llvm::raw_ostream& out_;
+  DiagnosticSet seen_;
+  std::mutex mutex_;
+  unsigned long results_ = 0;
+  unsigned long errCount_ = 0;
+};
+
+// Hands the errors of one TU to the writer as they arrive. When the TU is recorded for the incremental mode, they
+// are also appended to record as JSON lines.
+class MyDiagnosticConsumer : public clang::DiagnosticConsumer {
+ public:
+  MyDiagnosticConsumer(DiagnosticWriter& writer, std::string* record)
+      : writer_(writer), record_(record), errCount_(0) {}
+  void HandleDiagnostic(clang::DiagnosticsEngine::Level diagLevel, const clang::Diagnostic& info) override {
+    if (diagLevel != clang::DiagnosticsEngine::Level::Error && diagLevel != clang::DiagnosticsEngine::Level::Fatal) {
+      return;
+    }
+    Diag diag;
+    diag.level = levelToString(diagLevel);
+    diag.id = info.getID();
+    llvm::SmallString<128> message;
+    info.FormatDiagnostic(message);
+    diag.message = std::string(message);
+    if (info.hasSourceManager()) {
+      const clang::SourceManager& sm = info.getSourceManager();
+      clang::SourceLocation loc = sm.getSpellingLoc(info.getLocation());
+      const clang::FileEntry* entry = sm.getFileEntryForID(sm.getFileID(loc));
+      // the real path, so that a header reached through different relative paths is one file
+      diag.file = entry && !entry->tryGetRealPathName().empty() ? entry->tryGetRealPathName().str()
+                                                                : sm.getFilename(loc).str();
+      diag.offset = sm.getFileOffset(loc);
+      diag.line = sm.getSpellingLineNumber(loc);
+      diag.column = sm.getSpellingColumnNumber(loc);
+      ++errCount_;
+    }
+    if (record_) {
+      *record_ += toJsonLine(diag);
+    }
+    writer_.report(diag);
   }
   unsigned long getErrCount() const { return errCount_; }
 
  private:
+  DiagnosticWriter& writer_;
+  std::string* record_;
   unsigned long errCount_;
 };
 
-static llvm::cl::OptionCategory toolOptions("Tool Options");
+// The files read by the TU are appended to deps when it is set.
+class SyntaxOnlyActionFactory : public ct::FrontendActionFactory {
+ public:
+  explicit SyntaxOnlyActionFactory(std::vector<std::string>* deps) : deps_(deps) {}
+  std::unique_ptr<clang::FrontendAction> create() override {
+    std::unique_ptr<clang::FrontendAction> action = std::make_unique<clang::SyntaxOnlyAction>();
+    return deps_ ? IncrementalCache::recordDependencies(std::move(action), *deps_) : std::move(action);
+  }
+
+ private:
+  std::vector<std::string>* deps_;
+};
+
+// Runs the TUs one ClangTool each, on a thread pool when there is more than one job. Each TU can be given its own
+// cached preamble, or be replayed from its incremental record when that is still valid. The record keeps the TU's
+// errors as JSON lines and its error count as its status; replayed errors go through the same deduplication.
+class DiagnosticRunner {
+ public:
+  DiagnosticRunner(const ct::CompilationDatabase& compilations, const std::vector<std::string>& files,
+                   DiagnosticWriter& writer)
+      : compilations_(compilations), files_(files), writer_(writer) {
+    if (!pchCacheDir.empty()) {
+      pchCache_ = std::make_unique<PchCache>(pchCacheDir);
+    }
+    if (!incrementalDir.empty()) {
+      incremental_ = std::make_unique<IncrementalCache>(incrementalDir, "clang-diagnostic 2");
+    }
+  }
+
+  int run(unsigned numJobs) {
+    if (numJobs == 1 || files_.size() <= 1) {
+      for (const std::string& file : files_) {
+        process(file);
+      }
+    } else {
+      llvm::ThreadPool pool(llvm::hardware_concurrency(numJobs));
+      for (const std::string& file : files_) {
+        pool.async([this, &file] { process(file); });
+      }
+      pool.wait();
+    }
+    if (pchCache_) {
+      pchCache_->printStats(llvm::errs());
+    }
+    if (incremental_) {
+      incremental_->printStats(llvm::errs());
+    }
+    return status_;
+  }
+
+ private:
+  void process(const std::string& file) {
+    std::vector<ct::CompileCommand> commands;
+    if (pchCache_ || incremental_) {
+      commands = compilations_.getCompileCommands(ct::getAbsolutePath(file));
+    }
+    bool recorded = incremental_ && !commands.empty();
+    IncrementalCache::Record record;
+    if (recorded && incremental_->lookup(commands.front(), record)) {
+      llvm::SmallVector<llvm::StringRef, 8> lines;
+      llvm::StringRef(record.Output).split(lines, '\n', -1, /*KeepEmpty=*/false);
+      for (llvm::StringRef line : lines) {
+        Diag diag;
+        if (fromJsonLine(line, diag)) {
+          writer_.report(diag);
+        }
+      }
+      if (record.Status) {
+        status_ = 1;
+      }
+      return;
+    }
+
+    MyDiagnosticConsumer diagnosticConsumer(writer_, recorded ? &record.Output : nullptr);
+    // a file system of its own, changing the working directory of one TU does not move the others
+    ct::ClangTool tool(compilations_, {file}, std::make_shared<clang::PCHContainerOperations>(),
+                       llvm::vfs::createPhysicalFileSystem());
+    tool.setDiagnosticConsumer(&diagnosticConsumer);
+    PchCache::Entry pch;
+    if (pchCache_ && !commands.empty() && pchCache_->prepare(commands.front(), pch)) {
+      PchCache::apply(tool, pch);
+    }
+    std::vector<std::string> deps;
+    SyntaxOnlyActionFactory factory(recorded ? &deps : nullptr);
+    int fileStatus = tool.run(&factory);
+    if (fileStatus) {
+      status_ = 1;
+    }
+    // a TU that failed without an error of its own, e.g. a missing file, is not recorded
+    record.Status = diagnosticConsumer.getErrCount();
+    if (recorded && (!fileStatus || record.Status)) {
+      incremental_->store(commands.front(), deps, record);
+    }
+  }
+
+  const ct::CompilationDatabase& compilations_;
+  const std::vector<std::string>& files_;
+  DiagnosticWriter& writer_;
+  std::unique_ptr<PchCache> pchCache_;
+  std::unique_ptr<IncrementalCache> incremental_;
+  std::atomic<int> status_{0};
+};
 
 int main(int argc, char** argv) {
   auto expectedOptionsParser = ct::CommonOptionsParser::create(argc, const_cast<const char**>(argv), toolOptions);
@@ -55,13 +387,13 @@ int main(int argc, char** argv) {
     return 1;
   }
   ct::CommonOptionsParser& optionsParser = *expectedOptionsParser;
-  ct::ClangTool tool(optionsParser.getCompilations(), optionsParser.getSourcePathList());
-  MyDiagnosticConsumer diagnosticConsumer;
-  tool.setDiagnosticConsumer(&diagnosticConsumer);
-  int status = tool.run(ct::newFrontendActionFactory<clang::SyntaxOnlyAction>().get());
-  unsigned long errCount = diagnosticConsumer.getErrCount();
+  DiagnosticWriter writer;
+  DiagnosticRunner runner(optionsParser.getCompilations(), optionsParser.getSourcePathList(), writer);
+  int status = runner.run(jobs);
+  writer.finish();
+  unsigned long errCount = writer.getErrCount();
   if (errCount) {
     llvm::errs() << errCount << " error(s) occurred\n";
   }
   return (!status && !errCount) ? 0 : 1;
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -18,6 +19,10 @@
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "CompilerSession.h"
+#include "PchCache.h"
+#include "TraversalPolicy.h"
+
 using namespace clang;
 
 class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
@@ -76,66 +81,76 @@ class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
 
 class MyASTConsumer : public ASTConsumer {
  public:
-  MyASTConsumer(Rewriter &R) : Visitor(R) {}
+  MyASTConsumer(Rewriter &R) : Visitor(R), Policy(R.getSourceMgr()) {}
 
+  // Only the main file is rewritten, declarations from headers are not walked at all.
   virtual bool HandleTopLevelDecl(DeclGroupRef DR) {
-    for (DeclGroupRef::iterator b = DR.begin(), e = DR.end(); b != e; ++b) {
-      Visitor.TraverseDecl(*b);
-    }
+    Policy.traverse(Visitor, DR);
     return true;
   }
 
  private:
   MyASTVisitor Visitor;
+  TraversalPolicy Policy;
 };
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    llvm::errs() << "Usage: rewritersample <filename>\n";
+  // -pch-cache=<dir> keeps the precompiled #include block of the files in <dir>
+  // across runs.
+  int First = 1;
+  llvm::StringRef CacheDir;
+  if (argc > 1 && llvm::StringRef(argv[1]).startswith("-pch-cache=")) {
+    CacheDir = llvm::StringRef(argv[1]).drop_front(strlen("-pch-cache="));
+    First = 2;
+  }
+  if (argc <= First) {
+    llvm::errs() << "Usage: rewritersample [-pch-cache=<dir>] <filename>...\n";
     return 1;
   }
 
-  CompilerInstance CI;
-  CI.createDiagnostics();
-
-  LangOptions &lo = CI.getLangOpts();
+  // Diagnostics, target and file manager are set up once for all the files.
+  CompilerSession Session;
+  LangOptions &lo = Session.getLangOpts();
   lo.CPlusPlus = 1;
 
-  // initialize target info with the default triple for our platform.
-  auto TO = std::make_shared<TargetOptions>();
-  TO->Triple = llvm::sys::getDefaultTargetTriple();
-  TargetInfo *TI = TargetInfo::CreateTargetInfo(CI.getDiagnostics(), TO);
-  CI.setTarget(TI);
-
-  CI.createFileManager();
-  FileManager &FileMgr = CI.getFileManager();
-  CI.createSourceManager(FileMgr);
-  SourceManager &SourceMgr = CI.getSourceManager();
-  CI.createPreprocessor(TU_Module);
-  CI.createASTContext();
-
-  // A Rewriter helps us manage the code rewriting task.
-  Rewriter TheRewriter;
-  TheRewriter.setSourceMgr(SourceMgr, CI.getLangOpts());
-
-  // Set the main file handled by the source manager to the input file.
-  llvm::ErrorOr<const clang::FileEntry *> FileIn = FileMgr.getFile(argv[1]);
-  if (!FileIn) {
-    return FileIn.getError().value();
+  // Only the main file is rewritten, so the headers may as well come from a PCH.
+  std::unique_ptr<PchCache> Cache;
+  if (!CacheDir.empty()) {
+    Cache = std::make_unique<PchCache>(CacheDir.str());
+    Session.setPchCache(Cache.get());
   }
 
-  SourceMgr.setMainFileID(SourceMgr.createFileID(FileIn.get(), SourceLocation(), SrcMgr::C_User));
-  CI.getDiagnosticClient().BeginSourceFile(CI.getLangOpts(), &CI.getPreprocessor());
-
-  // Create an AST consumer instance which is going to get called by ParseAST
-  MyASTConsumer TheConsumer(TheRewriter);
-
-  // Parse the file to AST, registering our consumer as the AST consumer.
-  ParseAST(CI.getPreprocessor(), &TheConsumer, CI.getASTContext());
-
-  // At this point the rewriter's buffer should be full with the rewritten file contents.
-  const RewriteBuffer *RewriteBuf = TheRewriter.getRewriteBufferFor(SourceMgr.getMainFileID());
-  llvm::outs() << std::string(RewriteBuf->begin(), RewriteBuf->end());
+  int Status = 0;
+  for (int i = First; i < argc; ++i) {
+    // A fresh SourceManager, Preprocessor and ASTContext for each file.
+    if (!Session.begin(argv[i], /*Parse=*/true, TU_Module)) {
+      Status = 1;
+      continue;
+    }
+    SourceManager &SourceMgr = Session.getSourceManager();
+
+    // A Rewriter helps us manage the code rewriting task.
+    Rewriter TheRewriter;
+    TheRewriter.setSourceMgr(SourceMgr, Session.getLangOpts());
+
+    // Create an AST consumer instance which is going to get called by ParseAST
+    MyASTConsumer TheConsumer(TheRewriter);
+
+    // Parse the file to AST, registering our consumer as the AST consumer.
+    ParseAST(Session.getPreprocessor(), &TheConsumer, Session.getASTContext());
+
+    // At this point the rewriter's buffer should be full with the rewritten file contents,
+    // unless nothing was rewritten. A preamble compiled into the PCH was blanked out
+    // in the buffer and is put back.
+    const RewriteBuffer *RewriteBuf = TheRewriter.getRewriteBufferFor(SourceMgr.getMainFileID());
+    if (RewriteBuf)
+      llvm::outs() << Session.restorePreamble(std::string(RewriteBuf->begin(), RewriteBuf->end()));
+    else
+      llvm::outs() << Session.restorePreamble(SourceMgr.getBufferData(SourceMgr.getMainFileID()));
+    Session.end();
+  }
 
-  return 0;
-}
\ No newline at end of file
+  if (Cache)
+    Cache->printStats(llvm::errs());
+  return Status;
+}
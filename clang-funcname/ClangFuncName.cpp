@@ -1,112 +1,413 @@
-#include <cstdio>
-#include <string>
-#include <iostream>
-#include <sstream>
-#include <fstream>
-
-#include "clang/AST/AST.h"
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/RecursiveASTVisitor.h"
-#include "clang/Frontend/ASTConsumers.h"
-#include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendActions.h"
-#include "clang/Rewrite/Core/Rewriter.h"
-#include "clang/Tooling/CommonOptionsParser.h"
-#include "clang/Tooling/Tooling.h"
-#include "llvm/Support/raw_ostream.h"
-
-using namespace clang;
-using namespace clang::driver;
-using namespace clang::tooling;
-using namespace std;
-
-static llvm::cl::OptionCategory MyOptionCategory("MyOptions");
-static llvm::cl::opt<std::string> OutputFilename("o", 
-        llvm::cl::desc("Specify output filename that contains stmt:type"), 
-        llvm::cl::value_desc("output_filename"), llvm::cl::cat(MyOptionCategory));
-
-LangOptions MyLangOpts; 
-SourceManager *ptrMySourceMgr;
-Rewriter MyRewriter;
-
-class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
-public:
-  MyASTVisitor() {}
-  bool VisitStmt(Stmt *s) {
-    // Print a current statement and its type 
-    std::string str1;
-    llvm::raw_string_ostream os(str1);
-    s->printPretty(os, NULL, MyLangOpts);
-
-    puts("-----------------");
-    printf("%s\n", os.str().c_str());
-    printf("TYPE:%s\n", s->getStmtClassName());
-    fflush(stdout);
-    return true;
-  }
-
-  bool VisitFunctionDecl(FunctionDecl *f) { // Print function name
-    llvm::outs() << "*********************************\n";
-    llvm::outs() << "*** FUNCTION NAME:" <<  f->getName() << '\n';
-    llvm::outs() << "*********************************\n";
-    return true;
-  }
-};
-
-class MyASTConsumer : public ASTConsumer {
-public:
-  MyASTConsumer(): Visitor() {} //initialize MyASTVisitor
-
-  virtual bool HandleTopLevelDecl(DeclGroupRef DR) {
-    for (DeclGroupRef::iterator b = DR.begin(), e = DR.end(); b != e; ++b) {
-      // Travel each function declaration using MyASTVisitor
-      Visitor.TraverseDecl(*b);
-    }
-    return true;
-  }
-
-private:
-    MyASTVisitor Visitor;
-};
-
-class MyFrontendAction : public ASTFrontendAction {
-public:
-  MyFrontendAction() {}
- 
-  void EndSourceFileAction() override {
-  }
-
-  std::unique_ptr<ASTConsumer> CreateASTConsumer(
-                  CompilerInstance &CI, StringRef file) override {                                         
-
-    MyLangOpts = CI.getLangOpts();
-    ptrMySourceMgr= &(CI.getSourceManager());
-    MyRewriter= Rewriter(*ptrMySourceMgr, MyLangOpts);
-
-    return std::make_unique<MyASTConsumer>();
-  }
-};
-
-int main(int argc, const char **argv) {  
-  llvm::Expected<clang::tooling::CommonOptionsParser> ExpectedOp = CommonOptionsParser::create(argc, argv, MyOptionCategory);
-  if (!ExpectedOp) {
-    llvm::errs() << ExpectedOp.takeError();
-    return 1;
-  }
-
-  CommonOptionsParser &op = ExpectedOp.get();
-
-  ClangTool Tool(op.getCompilations(), op.getSourcePathList());
-  int ret = Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
-
-  /*
-  Rewriter sample. Save changed target code into output.txt if any 
-  const RewriteBuffer *RewriteBuf = MyRewriter.getRewriteBufferFor
-     ((*ptrMySourceMgr).getMainFileID());
-  ofstream out_file ("output.txt");
-  out_file << string(RewriteBuf->begin(), RewriteBuf->end());
-  out_file.close();
-  */
-
-  return ret;
-}
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "clang/AST/AST.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/ASTConsumers.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Basic/Version.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "IncrementalCache.h"
+#include "PchCache.h"
+#include "TraversalPolicy.h"
+
+using namespace clang;
+using namespace clang::driver;
+using namespace clang::tooling;
+using namespace std;
+
+static llvm::cl::OptionCategory MyOptionCategory("MyOptions");
+static llvm::cl::opt<std::string> OutputFilename("o",
+        llvm::cl::desc("Write the dump here instead of stdout"),
+        llvm::cl::value_desc("output_filename"), llvm::cl::cat(MyOptionCategory));
+static llvm::cl::opt<unsigned> Jobs("j",
+        llvm::cl::desc("Number of translation units to process in parallel (0 = all cores)"),
+        llvm::cl::init(1), llvm::cl::cat(MyOptionCategory));
+
+enum class OutputFormat { Text, JSONL, Binary };
+static llvm::cl::opt<OutputFormat> Format("format",
+        llvm::cl::desc("Output format"), llvm::cl::init(OutputFormat::Text),
+        llvm::cl::values(
+            clEnumValN(OutputFormat::Text, "text", "human readable dump"),
+            clEnumValN(OutputFormat::JSONL, "jsonl", "one JSON object per function or statement"),
+            clEnumValN(OutputFormat::Binary, "binary", "length-prefixed records, see FuncNameEmitter")),
+        llvm::cl::cat(MyOptionCategory));
+static llvm::cl::list<std::string> TraversePaths("traverse-path",
+        llvm::cl::desc("Also dump the declarations of files under this path (the main file always is)"),
+        llvm::cl::value_desc("path"), llvm::cl::cat(MyOptionCategory));
+static llvm::cl::opt<std::string> PchCacheDir("pch-cache",
+        llvm::cl::desc("Reuse precompiled preambles kept in this directory across runs"),
+        llvm::cl::value_desc("dir"), llvm::cl::cat(MyOptionCategory));
+static llvm::cl::opt<std::string> IncrementalDir("incremental",
+        llvm::cl::desc("Keep each TU's dump in this directory and reuse it while none of its files change"),
+        llvm::cl::value_desc("dir"), llvm::cl::cat(MyOptionCategory));
+
+// Writes the records of one TU in the selected format into a block buffer that
+// is handed to the sink whenever it holds BlockSize bytes, so a dump costs one
+// write per block rather than per statement. Statements are pretty-printed into
+// a scratch buffer; both buffers belong to the calling thread and keep their
+// capacity from one record and one TU to the next.
+//
+// jsonl:   {"kind":"function","name":...} and {"kind":"stmt","class":...,"text":...}
+// binary:  "CFNB", ULEB128 version, clang version (ULEB128 length + bytes), then
+//          records: tag 1, name | tag 2, ULEB128 Stmt::StmtClass, text
+//          where strings are ULEB128 length + bytes. Statement classes are
+//          numbered as in the clang version of the header.
+class FuncNameEmitter {
+public:
+  static const size_t BlockSize = 1 << 16;
+  static const unsigned BinaryVersion = 1;
+
+  FuncNameEmitter(const LangOptions &LangOpts, llvm::SmallVectorImpl<char> &Block,
+                  llvm::SmallVectorImpl<char> &Scratch,
+                  std::function<void(StringRef)> Sink)
+      : Policy(LangOpts), Block(Block), Scratch(Scratch), OS(Block),
+        Sink(std::move(Sink)) {
+    Block.clear();
+    Block.reserve(BlockSize + BlockSize / 4);
+  }
+
+  static void writeHeader(llvm::raw_ostream &Out) {
+    if (Format != OutputFormat::Binary)
+      return;
+    Out << "CFNB";
+    llvm::encodeULEB128(BinaryVersion, Out);
+    writeString(Out, getClangFullVersion());
+  }
+
+  void function(FunctionDecl *f) {
+    switch (Format) {
+    case OutputFormat::Text:
+      OS << "*********************************\n";
+      OS << "*** FUNCTION NAME:" << f->getName() << '\n';
+      OS << "*********************************\n";
+      break;
+    case OutputFormat::JSONL: {
+      llvm::json::OStream J(OS);
+      J.object([&] {
+        J.attribute("kind", "function");
+        J.attribute("name", f->getName());
+      });
+      OS << '\n';
+      break;
+    }
+    case OutputFormat::Binary:
+      OS << char(1);
+      writeString(OS, f->getName());
+      break;
+    }
+    maybeFlush();
+  }
+
+  void stmt(Stmt *s) {
+    if (Format == OutputFormat::Text) {
+      OS << "-----------------\n";
+      s->printPretty(OS, NULL, Policy);
+      OS << "\nTYPE:" << s->getStmtClassName() << "\n";
+      maybeFlush();
+      return;
+    }
+    Scratch.clear();
+    llvm::raw_svector_ostream Text(Scratch);
+    s->printPretty(Text, NULL, Policy);
+    if (Format == OutputFormat::JSONL) {
+      llvm::json::OStream J(OS);
+      J.object([&] {
+        J.attribute("kind", "stmt");
+        J.attribute("class", s->getStmtClassName());
+        J.attribute("text", StringRef(Scratch.data(), Scratch.size()));
+      });
+      OS << '\n';
+    } else {
+      OS << char(2);
+      llvm::encodeULEB128(s->getStmtClass(), OS);
+      writeString(OS, StringRef(Scratch.data(), Scratch.size()));
+    }
+    maybeFlush();
+  }
+
+  void flush() {
+    if (!Block.empty()) {
+      Sink(StringRef(Block.data(), Block.size()));
+      Block.clear();
+    }
+  }
+
+private:
+  static void writeString(llvm::raw_ostream &Out, StringRef Str) {
+    llvm::encodeULEB128(Str.size(), Out);
+    Out << Str;
+  }
+
+  void maybeFlush() {
+    if (Block.size() >= BlockSize)
+      flush();
+  }
+
+  PrintingPolicy Policy;
+  llvm::SmallVectorImpl<char> &Block;
+  llvm::SmallVectorImpl<char> &Scratch;
+  llvm::raw_svector_ostream OS;
+  std::function<void(StringRef)> Sink;
+};
+
+// All state is per translation unit, so that TUs can be processed on any thread.
+// The visitor writes to the TU's own emitter, see FuncNameRunner for the ordering.
+class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
+public:
+  explicit MyASTVisitor(FuncNameEmitter &Emitter) : Emitter(Emitter) {}
+
+  bool VisitStmt(Stmt *s) {
+    // Print a current statement and its type
+    Emitter.stmt(s);
+    return true;
+  }
+
+  bool VisitFunctionDecl(FunctionDecl *f) { // Print function name
+    Emitter.function(f);
+    return true;
+  }
+
+private:
+  FuncNameEmitter &Emitter;
+};
+
+class MyASTConsumer : public ASTConsumer {
+public:
+  MyASTConsumer(CompilerInstance &CI, std::function<void(StringRef)> Sink)
+      : Emitter(CI.getLangOpts(), Block, Scratch, std::move(Sink)), Visitor(Emitter),
+        Policy(CI.getSourceManager(), TraversePaths) {}
+
+  void HandleTranslationUnit(ASTContext &Context) override { Emitter.flush(); }
+
+  virtual bool HandleTopLevelDecl(DeclGroupRef DR) {
+    // Travel each declaration of the main file using MyASTVisitor
+    Policy.traverse(Visitor, DR);
+    return true;
+  }
+
+private:
+  static thread_local llvm::SmallString<0> Block;
+  static thread_local llvm::SmallString<0> Scratch;
+  FuncNameEmitter Emitter;
+  MyASTVisitor Visitor;
+  TraversalPolicy Policy;
+};
+
+thread_local llvm::SmallString<0> MyASTConsumer::Block;
+thread_local llvm::SmallString<0> MyASTConsumer::Scratch;
+
+class MyFrontendAction : public ASTFrontendAction {
+public:
+  explicit MyFrontendAction(std::function<void(StringRef)> Sink) : Sink(std::move(Sink)) {}
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(
+                  CompilerInstance &CI, StringRef file) override {
+    return std::make_unique<MyASTConsumer>(CI, Sink);
+  }
+
+private:
+  std::function<void(StringRef)> Sink;
+};
+
+class MyFrontendActionFactory : public FrontendActionFactory {
+public:
+  // The files read by the TU are appended to Deps when it is set.
+  MyFrontendActionFactory(std::function<void(StringRef)> Sink, std::vector<std::string> *Deps)
+      : Sink(std::move(Sink)), Deps(Deps) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    std::unique_ptr<FrontendAction> Action = std::make_unique<MyFrontendAction>(Sink);
+    if (Deps)
+      Action = IncrementalCache::recordDependencies(std::move(Action), *Deps);
+    return Action;
+  }
+
+private:
+  std::function<void(StringRef)> Sink;
+  std::vector<std::string> *Deps;
+};
+
+// Runs one ClangTool per translation unit on a thread pool. The TU that is next
+// in line, the first one not yet finished in the order the TUs were given,
+// writes its blocks straight to the output; the others keep theirs until the
+// TUs before them are done. Diagnostics are kept per TU and written when it
+// finishes. So the output is the same as a serial run whatever the number of jobs.
+// A TU whose incremental record is still valid replays the record instead of
+// running.
+class FuncNameRunner {
+public:
+  FuncNameRunner(const CompilationDatabase &Compilations,
+                 const std::vector<std::string> &Files, llvm::raw_ostream &Out,
+                 PchCache *Cache, IncrementalCache *Incremental)
+      : Compilations(Compilations), Files(Files), Out(Out), Cache(Cache),
+        Incremental(Incremental), Results(Files.size()) {}
+
+  int run(unsigned NumJobs) {
+    if (NumJobs == 1 || Files.size() <= 1) {
+      for (size_t i = 0; i < Files.size(); ++i)
+        process(i);
+    } else {
+      llvm::ThreadPool Pool(llvm::hardware_concurrency(NumJobs));
+      for (size_t i = 0; i < Files.size(); ++i)
+        Pool.async([this, i] { process(i); });
+      Pool.wait();
+    }
+    Out.flush();
+    return Failed ? 1 : 0;
+  }
+
+private:
+  struct Result {
+    std::string Out;
+    std::string Err;
+    bool Done = false;
+  };
+
+  void process(size_t i) {
+    std::vector<CompileCommand> Cmds;
+    if (Cache || Incremental)
+      Cmds = Compilations.getCompileCommands(getAbsolutePath(Files[i]));
+    bool Recorded = Incremental && !Cmds.empty();
+    IncrementalCache::Record Record;
+    if (Recorded && Incremental->lookup(Cmds.front(), Record)) {
+      write(i, Record.Output);
+      if (Record.Status)
+        Failed = true;
+      finish(i, std::move(Record.Errors));
+      return;
+    }
+
+    std::string Err;
+    std::vector<std::string> Deps;
+    {
+      llvm::raw_string_ostream ErrOS(Err);
+      IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+      TextDiagnosticPrinter DiagPrinter(ErrOS, &*DiagOpts);
+
+      // a file system of its own, changing the working directory of one TU
+      // does not move the others
+      ClangTool Tool(Compilations, {Files[i]}, std::make_shared<PCHContainerOperations>(),
+                     llvm::vfs::createPhysicalFileSystem());
+      Tool.setDiagnosticConsumer(&DiagPrinter);
+      PchCache::Entry Pch;
+      if (Cache && !Cmds.empty() && Cache->prepare(Cmds.front(), Pch))
+        PchCache::apply(Tool, Pch);
+      MyFrontendActionFactory Factory(
+          [this, i, Recorded, &Record](StringRef Data) {
+            if (Recorded)
+              Record.Output.append(Data.begin(), Data.end());
+            write(i, Data);
+          },
+          Recorded ? &Deps : nullptr);
+      Record.Status = Tool.run(&Factory) != 0;
+      if (Record.Status)
+        Failed = true;
+    }
+    if (Recorded) {
+      Record.Errors = Err;
+      Incremental->store(Cmds.front(), Deps, Record);
+    }
+    finish(i, std::move(Err));
+  }
+
+  void write(size_t i, StringRef Data) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (i == Next)
+      Out << Data;
+    else
+      Results[i].Out.append(Data.begin(), Data.end());
+  }
+
+  // Marks TU i done and writes out every finished TU that is next in line.
+  void finish(size_t i, std::string Err) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Results[i].Err = std::move(Err);
+    Results[i].Done = true;
+    while (Next < Results.size() && Results[Next].Done) {
+      llvm::errs() << Results[Next].Err;
+      Results[Next] = Result();
+      ++Next;
+      // the new TU in line writes directly from now on, catch up on its blocks
+      if (Next < Results.size()) {
+        Out << Results[Next].Out;
+        std::string().swap(Results[Next].Out);
+      }
+    }
+    llvm::errs().flush();
+  }
+
+  const CompilationDatabase &Compilations;
+  const std::vector<std::string> &Files;
+  llvm::raw_ostream &Out;
+  PchCache *Cache;
+  IncrementalCache *Incremental;
+  std::mutex Mutex;
+  std::vector<Result> Results;
+  size_t Next = 0;
+  std::atomic<bool> Failed{false};
+};
+
+int main(int argc, const char **argv) {
+  llvm::Expected<clang::tooling::CommonOptionsParser> ExpectedOp = CommonOptionsParser::create(argc, argv, MyOptionCategory);
+  if (!ExpectedOp) {
+    llvm::errs() << ExpectedOp.takeError();
+    return 1;
+  }
+
+  CommonOptionsParser &op = ExpectedOp.get();
+
+  std::unique_ptr<llvm::raw_fd_ostream> File;
+  if (!OutputFilename.empty()) {
+    std::error_code EC;
+    File = std::make_unique<llvm::raw_fd_ostream>(OutputFilename, EC);
+    if (EC) {
+      llvm::errs() << OutputFilename << ": " << EC.message() << "\n";
+      return 1;
+    }
+  }
+  llvm::raw_ostream &Out = File ? *File : llvm::outs();
+  FuncNameEmitter::writeHeader(Out);
+
+  std::unique_ptr<PchCache> Cache;
+  // Declarations loaded from a PCH never reach HandleTopLevelDecl, so the
+  // headers under -traverse-path would lose their inline functions, members
+  // and templates. Those runs parse their headers.
+  if (!PchCacheDir.empty() && !TraversePaths.empty())
+    llvm::errs() << "warning: -pch-cache is ignored with -traverse-path\n";
+  else if (!PchCacheDir.empty())
+    Cache = std::make_unique<PchCache>(PchCacheDir);
+
+  std::unique_ptr<IncrementalCache> Incremental;
+  if (!IncrementalDir.empty()) {
+    // the dump of a TU also depends on the output format and the traversed paths
+    std::string Salt = "clang-funcname " + std::to_string(static_cast<int>(Format.getValue()));
+    for (const std::string &Path : TraversePaths)
+      Salt += " " + Path;
+    Incremental = std::make_unique<IncrementalCache>(IncrementalDir, Salt);
+  }
+
+  FuncNameRunner Runner(op.getCompilations(), op.getSourcePathList(), Out, Cache.get(),
+                        Incremental.get());
+  int Ret = Runner.run(Jobs);
+  if (Cache)
+    Cache->printStats(llvm::errs());
+  if (Incremental)
+    Incremental->printStats(llvm::errs());
+  return Ret;
+}
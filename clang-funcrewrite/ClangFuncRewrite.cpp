@@ -12,11 +12,16 @@
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "TraversalPolicy.h"
+
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
 
 static llvm::cl::OptionCategory ToolingSampleCategory("Tooling Sample");
+static llvm::cl::list<std::string> TraversePaths(
+    "traverse-path", llvm::cl::desc("Also visit the declarations of files under this path (the main file always is)"),
+    llvm::cl::value_desc("path"), llvm::cl::cat(ToolingSampleCategory));
 
 class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
  public:
@@ -48,10 +53,13 @@ class MyASTVisitor : public RecursiveASTVisitor<MyASTVisitor> {
 
 class MyASTConsumer : public ASTConsumer {
  public:
-  MyASTConsumer(Rewriter &R) : Visitor(R) {}
+  MyASTConsumer(Rewriter &R) : Visitor(R), Policy(R.getSourceMgr(), TraversePaths) {}
 
   bool HandleTopLevelDecl(DeclGroupRef DR) override {
     for (DeclGroupRef::iterator b = DR.begin(), e = DR.end(); b != e; ++b) {
+      if (!Policy.shouldTraverse(*b)) {
+        continue;
+      }
       Visitor.TraverseDecl(*b);
       (*b)->dump();
     }
@@ -60,6 +68,7 @@ class MyASTConsumer : public ASTConsumer {
 
  private:
   MyASTVisitor Visitor;
+  TraversalPolicy Policy;
 };
 
 // for each source file provided to the tool, a new FrontendAction is created
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+class Environment;
+
+/// A host function that interpreted code can call. It gets the evaluated arguments and returns
+/// the value of the call, which is ignored for functions declared `void`.
+using NativeFn = int (*)(Environment &env, llvm::ArrayRef<int> args);
+
+struct Builtin {
+  llvm::StringRef mName_;
+  unsigned mNumParams_;
+  bool mReturnsValue_;
+  bool mExternal_;  /// reads or writes outside the interpreter, e.g. the terminal
+  NativeFn mFn_;
+};
+
+/// Maps the names of extern functions to native implementations. A function the program
+/// declares without a body is bound to the builtin of the same name, if its signature matches.
+class BuiltinRegistry {
+ public:
+  /// registers `fn` for calls to `name`, replacing an earlier registration
+  void add(llvm::StringRef name, unsigned numParams, bool returnsValue, NativeFn fn, bool external = false) {
+    auto &entry = *mBuiltins_.try_emplace(name).first;
+    entry.second = {entry.first(), numParams, returnsValue, external, fn};
+  }
+
+  const Builtin *lookup(llvm::StringRef name) const {
+    auto it = mBuiltins_.find(name);
+    return it == mBuiltins_.end() ? nullptr : &it->second;
+  }
+
+ private:
+  llvm::StringMap<Builtin> mBuiltins_;
+};
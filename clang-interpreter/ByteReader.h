@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/LEB128.h"
+
+/// Bounds-checked reader of the LEB128 encoded files of the interpreter (snapshots and traces).
+/// A read past the end or a malformed number puts the reader in a failed state, in which every
+/// later read returns 0 or an empty string, so a caller can read a whole record and check ok()
+/// once.
+class ByteReader {
+ public:
+  explicit ByteReader(llvm::StringRef data = llvm::StringRef())
+      : mPtr_(data.bytes_begin()), mEnd_(data.bytes_end()), mOk_(true) {}
+
+  bool ok() const { return mOk_; }
+  bool atEnd() const { return mPtr_ == mEnd_; }
+  uint64_t remaining() const { return mEnd_ - mPtr_; }
+  void fail() { mOk_ = false; }
+
+  bool expect(llvm::StringRef tag) {
+    if (bytes(tag.size()) != tag) {
+      fail();
+    }
+    return mOk_;
+  }
+
+  uint64_t u() {
+    const char *error = nullptr;
+    unsigned n = 0;
+    uint64_t val = llvm::decodeULEB128(mPtr_, &n, mEnd_, &error);
+    return consume(n, error) ? val : 0;
+  }
+
+  int64_t s() {
+    const char *error = nullptr;
+    unsigned n = 0;
+    int64_t val = llvm::decodeSLEB128(mPtr_, &n, mEnd_, &error);
+    return consume(n, error) ? val : 0;
+  }
+
+  llvm::StringRef bytes(uint64_t n) {
+    if (!mOk_ || n > uint64_t(mEnd_ - mPtr_)) {
+      fail();
+      return llvm::StringRef();
+    }
+    llvm::StringRef res((const char *)mPtr_, n);
+    mPtr_ += n;
+    return res;
+  }
+
+ private:
+  bool consume(unsigned n, const char *error) {
+    if (!mOk_ || error) {
+      fail();
+      return false;
+    }
+    mPtr_ += n;
+    return true;
+  }
+
+  const uint8_t *mPtr_;
+  const uint8_t *mEnd_;
+  bool mOk_;
+};
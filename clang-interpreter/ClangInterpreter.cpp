@@ -1,253 +1,113 @@
-#include <iostream>
-
-#include "clang/AST/AST.h"
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/EvaluatedExprVisitor.h"
-#include "clang/AST/RecursiveASTVisitor.h"
-#include "clang/Frontend/ASTConsumers.h"
-#include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendActions.h"
-#include "clang/Rewrite/Core/Rewriter.h"
-#include "clang/Tooling/CommonOptionsParser.h"
-#include "clang/Tooling/Tooling.h"
-#include "llvm/Support/raw_ostream.h"
-
-#include "clang/Basic/Diagnostic.h"
-#include "clang/Basic/FileManager.h"
-#include "clang/Basic/SourceManager.h"
-#include "clang/Basic/TargetInfo.h"
-#include "clang/Basic/TargetOptions.h"
-#include "clang/Lex/Preprocessor.h"
-#include "clang/Parse/ParseAST.h"
-#include "clang/Rewrite/Frontend/Rewriters.h"
-#include "llvm/Support/Host.h"
-
-#include "Environment.h"
-
-using namespace clang;
-
-class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor> {
- public:
-  explicit InterpreterVisitor(const ASTContext &context, Environment *env) : EvaluatedExprVisitor(context), mEnv_(env) {
-    env->setInterpreter(this);
-  }
-
-  virtual ~InterpreterVisitor() = default;
-
-  virtual void VisitBinaryOperator(BinaryOperator *bop) {
-    bop->dump();
-    VisitStmt(bop);
-    mEnv_->binop(bop);
-  }
-
-  virtual void VisitUnaryOperator(UnaryOperator *uop) {
-    uop->dump();
-    VisitStmt(uop);
-    mEnv_->uop(uop);
-  }
-
-  virtual void VisitIntegerLiteral(IntegerLiteral *il) {
-    il->dump();
-    int val = il->getValue().getSExtValue();
-    mEnv_->bindStmt(il, val);
-  }
-
-  virtual void VisitDeclRefExpr(DeclRefExpr *expr) {
-    expr->dump();
-    VisitStmt(expr);
-    mEnv_->declref(expr);
-  }
-
-  virtual void VisitCastExpr(CastExpr *expr) {
-    expr->dump();
-    VisitStmt(expr);
-    mEnv_->cast(expr);
-  }
-
-  virtual void VisitCallExpr(CallExpr *call) {
-    call->dump();
-    VisitStmt(call);
-    bool not_builtin = mEnv_->call(call);
-    try {
-      if (not_builtin) {
-        VisitStmt(mEnv_->stackTop().getPC());
-      }
-    } catch (ReturnException &e) {
-      int ret_val = e.getRetVal();
-      mEnv_->stackPop();
-      mEnv_->stackTop().bindStmt(call, ret_val);
+#include <chrono>
+#include <thread>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+
+#include "Interpreter.h"
+
+static llvm::cl::OptionCategory InterpreterCategory("clang-interpreter options");
+static llvm::cl::opt<std::string> Input(llvm::cl::Positional, llvm::cl::desc("<program file, - for stdin>"),
+                                        llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> Code("e", llvm::cl::desc("Interpret the program text given here"),
+                                       llvm::cl::value_desc("program text"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> SnapshotOut("snapshot-out",
+                                              llvm::cl::desc("Write a snapshot here whenever CHECKPOINT() is called"),
+                                              llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> SnapshotIn("snapshot-in", llvm::cl::desc("Resume the program from a snapshot"),
+                                             llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<bool> Stats("stats", llvm::cl::desc("Print execution counters when the program exits"),
+                                 llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> HeapReportFile("heap-report",
+                                                 llvm::cl::desc("Write heap usage and leaks as JSON (- for stdout)"),
+                                                 llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> CoverageFile("coverage",
+                                                llvm::cl::desc("Write line, function and branch counts as lcov"),
+                                                llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> BranchBiasFile("branch-bias",
+                                                  llvm::cl::desc("Write taken/not-taken counts of conditions as JSON"),
+                                                  llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> RecordFile("record", llvm::cl::desc("Record every builtin call to a trace"),
+                                              llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> ReplayFile("replay",
+                                             llvm::cl::desc("Feed back the builtin calls of a recorded trace"),
+                                             llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> ProfileFile("profile",
+                                              llvm::cl::desc("Sample the interpreted stack, write folded stacks"),
+                                              llvm::cl::value_desc("file"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<int> ProfileHz("profile-hz", llvm::cl::desc("Samples per second of CPU time for -profile"),
+                                    llvm::cl::init(1000), llvm::cl::cat(InterpreterCategory));
+enum class Engine { Ast, RegIR };
+static llvm::cl::opt<Engine> EngineKind(
+    "engine", llvm::cl::desc("How to execute the program"), llvm::cl::init(Engine::Ast),
+    llvm::cl::values(clEnumValN(Engine::Ast, "ast", "walk the AST"),
+                     clEnumValN(Engine::RegIR, "regir", "lower functions to register code, falls back to ast")),
+    llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<bool> Session("session",
+                                   llvm::cl::desc("Rerun the program file whenever it changes, on register code, "
+                                                  "lowering only the functions that changed"),
+                                   llvm::cl::cat(InterpreterCategory));
+
+/// reruns the program at `path` every time it is saved, until interrupted
+static int runSession(const std::string &path, InterpreterOptions options) {
+  RegCache cache;
+  options.mRegIR_ = true;
+  options.mRegCache_ = &cache;
+  llvm::sys::TimePoint<> last;
+  while (true) {
+    llvm::sys::fs::file_status status;
+    if (std::error_code ec = llvm::sys::fs::status(path, status)) {
+      llvm::errs() << path << ": " << ec.message() << "\n";
+      return 1;
     }
-  }
-
-  virtual void VisitDeclStmt(DeclStmt *declstmt) {
-    declstmt->dump();
-    mEnv_->decl(declstmt);
-  }
-
-  int getChildrenSize(Stmt *stmt) {
-    int i = 0;
-    for (auto *c : stmt->children()) {
-      i++;
+    if (status.getLastModificationTime() != last) {
+      last = status.getLastModificationTime();
+      cache.beginRun();
+      interpretFile(path, options);
+      cache.endRun();
+      cache.printStats(llvm::outs());
+      llvm::outs() << "session: waiting for " << path << " to change\n";
+      llvm::outs().flush();
     }
-    return i;
-  }
-
-  virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *arrsubexpr) {
-    arrsubexpr->dump();
-    // llvm::outs() << "children size: " << getChildrenSize(arrsubexpr) << "\n";
-    VisitStmt(arrsubexpr);
-    mEnv_->arraysub(arrsubexpr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
   }
+}
 
-  virtual void VisitReturnStmt(ReturnStmt *retstmt) {
-    retstmt->dump();
-    VisitStmt(retstmt);
-    mEnv_->retrn(retstmt);
-  }
-
-  virtual void VisitIfStmt(IfStmt *ifstmt) {
-    ifstmt->dump();
-    Expr *cond_expr = ifstmt->getCond();
-    this->Visit(cond_expr);
-    int cond = mEnv_->stackTop().getStmtVal(cond_expr);
-    if (cond) {
-      // llvm::outs() << "then branch\n";
-      if (ifstmt->getThen()) {
-        this->Visit(ifstmt->getThen());
-      }
-    } else {
-      if (ifstmt->getElse()) {
-        this->Visit(ifstmt->getElse());
-      }
-      // llvm::outs() << "else branch\n";
-    }
-  }
-
-  virtual void VisitWhileStmt(WhileStmt *wstmt) {
-    wstmt->dump();
-    Expr *cond_expr = wstmt->getCond();
-    do {
-      this->Visit(cond_expr);
-      int cond = mEnv_->getStmtVal(cond_expr);
-      if (!cond) {
-        break;
-      }
-      this->Visit(wstmt->getBody());
-    } while (true);
-  }
-
-  virtual void VisitForStmt(ForStmt *fstmt) {
-    fstmt->dump();
-    Stmt *initstmt = fstmt->getInit();
-    if (initstmt) {
-      this->Visit(initstmt);
-    }
-    Expr *cond_expr = fstmt->getCond();
-    do {
-      this->Visit(cond_expr);
-      int cond = mEnv_->getStmtVal(cond_expr);
-      if (!cond) {
-        break;
-      }
-      this->Visit(fstmt->getBody());
-      this->Visit(fstmt->getInc());
-    } while (true);
-  }
-
-  virtual void VisitCStyleCastExpr(CStyleCastExpr *ccastexpr) {
-    ccastexpr->dump();
-    this->VisitStmt(ccastexpr);
-    stealBindingFromChild(ccastexpr);
-  }
-
-  virtual void VisitImplicitCastExpr(ImplicitCastExpr *icastexpr) {
-    icastexpr->dump();
-    this->VisitStmt(icastexpr);
-    stealBindingFromChild(icastexpr);
-  }
-
-  virtual void VisitParenExpr(ParenExpr *parenexpr) {
-    parenexpr->dump();
-    this->VisitStmt(parenexpr);
-    stealBindingFromChild(parenexpr);
-  }
-
-  /// for some AST(e.g., ImplicitCastExpr, CStyleCastExpr), we need to have their "value" binding
-  /// so we steal the value binding from their children. usually, they have only one child
-  void stealBindingFromChild(Stmt *parent) {
-    parent->dump();
-    Stmt *stmt = nullptr;
-    for (auto *c : parent->children()) {
-      stmt = c;
-      break;
-    }
-
-    if (stmt) {
-      if (mEnv_->stackTop().hasStmt(stmt)) {
-        mEnv_->bindStmt(parent, mEnv_->stackTop().getStmtVal(stmt));
-        // llvm::outs() << "succ\n";
-        // stmt->dump();
-        return;
-      }
-    }
-  }
-
-  virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *uexpr) {
-    uexpr->dump();
-    this->VisitStmt(uexpr);
-    /// we assume the op must be `sizeof`
-    // uexpr->getExprStmt()->dump();
-    auto arg_type = uexpr->getArgumentTypeInfo()->getType();
-    int sz = 0;
-    if (arg_type->isPointerType()) {
-      sz = sizeof(Heap::HeapAddr);
-    } else if (arg_type->isIntegerType()) {
-      sz = sizeof(int);
-    } else {
-      llvm::outs() << "Unknown Type:\n";
-      arg_type.dump();
-      throw std::exception();
-    }
-    mEnv_->bindStmt(uexpr, sz);
-  }
-
- private:
-  Environment *mEnv_;
-};
-
-class InterpreterConsumer : public ASTConsumer {
- public:
-  explicit InterpreterConsumer(const ASTContext &context) : mVisitor_(context, &mEnv_) {}
-  ~InterpreterConsumer() override = default;
-
-  void HandleTranslationUnit(clang::ASTContext &Context) override {
-    TranslationUnitDecl *decl = Context.getTranslationUnitDecl();
-    mEnv_.init(decl);
-    FunctionDecl *entry = mEnv_.getEntry();
-    try {
-      mVisitor_.VisitStmt(entry->getBody());
-    } catch (ReturnException &e) {
-      if (e.getRetVal() != 0) {
-        llvm::outs() << "main exit with a non-zero code!\n";
-      }
+int main(int argc, char **argv) {
+  llvm::cl::HideUnrelatedOptions(InterpreterCategory);
+  llvm::cl::ParseCommandLineOptions(argc, argv, "a tiny C interpreter built on clang\n");
+
+  InterpreterOptions options;
+  options.mSnapshotOut_ = SnapshotOut;
+  options.mSnapshotIn_ = SnapshotIn;
+  options.mStats_ = Stats;
+  options.mHeapReport_ = HeapReportFile;
+  options.mCoverage_ = CoverageFile;
+  options.mBranchBias_ = BranchBiasFile;
+  options.mRecord_ = RecordFile;
+  options.mReplay_ = ReplayFile;
+  options.mProfile_ = ProfileFile;
+  options.mProfileHz_ = ProfileHz;
+  options.mRegIR_ = EngineKind == Engine::RegIR;
+
+  if (!RecordFile.empty() && !ReplayFile.empty()) {
+    llvm::errs() << "-record and -replay cannot be used together\n";
+    return 1;
+  }
+
+  if (Session) {
+    if (Input.empty() || Input == "-" || !Code.empty()) {
+      llvm::errs() << "-session needs a program file to watch\n";
+      return 1;
     }
+    return runSession(Input, options);
   }
-
- private:
-  Environment mEnv_;
-  InterpreterVisitor mVisitor_;
-};
-
-class InterpreterFrontendAction : public ASTFrontendAction {
- public:
-  std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &ci,
-                                                        llvm::StringRef /*InFile*/) override {
-    return std::unique_ptr<clang::ASTConsumer>(new InterpreterConsumer(ci.getASTContext()));
+  if (!Code.empty()) {
+    return interpretBuffer(llvm::MemoryBuffer::getMemBuffer(Code, "-e"), "input.cc", options) ? 0 : 1;
   }
-};
-
-int main(int argc, char **argv) {
-  if (argc > 1) {
-    clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterFrontendAction), argv[1]);
+  if (Input.empty()) {
+    llvm::errs() << "no program given, pass a file, - for stdin, or -e <program text>\n";
+    return 1;
   }
-}
\ No newline at end of file
+  return interpretFile(Input, options) ? 0 : 1;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace clang;
+
+/// Execution counts of the statements, functions and branch conditions of the main file. The
+/// executable statements are registered up front so that the ones that never ran are reported
+/// with a zero count. Counting is keyed by AST node, lines are only computed when writing.
+class Coverage : public RecursiveASTVisitor<Coverage> {
+ public:
+  Coverage(TranslationUnitDecl *unit, const SourceManager &sm) : mSM_(sm) { TraverseDecl(unit); }
+
+  bool VisitFunctionDecl(FunctionDecl *fdecl) {
+    if (fdecl->doesThisDeclarationHaveABody() && inMainFile(fdecl->getBody())) {
+      mFunctions_.push_back({fdecl, fdecl->getBody()});
+      mCounts_[fdecl->getBody()];
+    }
+    return true;
+  }
+
+  bool VisitCompoundStmt(CompoundStmt *cstmt) {
+    for (Stmt *child : cstmt->body()) {
+      addStmt(child);
+    }
+    return true;
+  }
+
+  bool VisitIfStmt(IfStmt *ifstmt) {
+    addBranch(ifstmt, "if");
+    addStmt(ifstmt->getThen());
+    addStmt(ifstmt->getElse());
+    return true;
+  }
+
+  bool VisitWhileStmt(WhileStmt *wstmt) {
+    addBranch(wstmt, "while");
+    addStmt(wstmt->getBody());
+    return true;
+  }
+
+  bool VisitForStmt(ForStmt *fstmt) {
+    if (fstmt->getCond()) {
+      addBranch(fstmt, "for");
+    }
+    addStmt(fstmt->getBody());
+    return true;
+  }
+
+  /// `stmt` is about to run, for a function body: the function was entered
+  void hit(Stmt *stmt) {
+    auto it = mCounts_.find(stmt);
+    if (it != mCounts_.end()) {
+      it->second++;
+    }
+  }
+
+  /// the condition of an if or a loop was evaluated, `taken` means the then branch or body runs
+  void branch(Stmt *stmt, bool taken) {
+    auto it = mBranches_.find(stmt);
+    if (it != mBranches_.end()) {
+      (taken ? it->second.mTaken_ : it->second.mNotTaken_)++;
+    }
+  }
+
+  /// lcov tracefile, as read by genhtml and lcov itself
+  void writeLcov(llvm::raw_ostream &os) const {
+    os << "TN:\n";
+    os << "SF:" << mSM_.getFileEntryForID(mSM_.getMainFileID())->getName() << "\n";
+    unsigned hit_functions = 0;
+    for (const Function &fn : mFunctions_) {
+      os << "FN:" << line(fn.mBody_) << "," << fn.mDecl_->getName() << "\n";
+    }
+    for (const Function &fn : mFunctions_) {
+      uint64_t count = mCounts_.lookup(fn.mBody_);
+      hit_functions += count != 0;
+      os << "FNDA:" << count << "," << fn.mDecl_->getName() << "\n";
+    }
+    os << "FNF:" << mFunctions_.size() << "\nFNH:" << hit_functions << "\n";
+
+    unsigned hit_branches = 0;
+    for (size_t block = 0; block < mBranchOrder_.size(); ++block) {
+      const BranchSite &site = mBranchOrder_[block];
+      const BranchCounts &counts = mBranches_.find(site.mStmt_)->second;
+      unsigned ln = line(site.mStmt_);
+      /// lcov prints "-" for a branch whose condition never ran; the block number keeps two
+      /// conditions on one line apart
+      bool ran = counts.mTaken_ + counts.mNotTaken_ != 0;
+      os << "BRDA:" << ln << "," << block << ",0," << (ran ? std::to_string(counts.mTaken_) : "-") << "\n";
+      os << "BRDA:" << ln << "," << block << ",1," << (ran ? std::to_string(counts.mNotTaken_) : "-") << "\n";
+      hit_branches += (counts.mTaken_ != 0) + (counts.mNotTaken_ != 0);
+    }
+    os << "BRF:" << 2 * mBranchOrder_.size() << "\nBRH:" << hit_branches << "\n";
+
+    /// a line runs as often as its most executed statement
+    std::map<unsigned, uint64_t> lines;
+    for (Stmt *stmt : mStmts_) {
+      uint64_t &count = lines[line(stmt)];
+      count = std::max(count, mCounts_.lookup(stmt));
+    }
+    unsigned hit_lines = 0;
+    for (const auto &entry : lines) {
+      hit_lines += entry.second != 0;
+      os << "DA:" << entry.first << "," << entry.second << "\n";
+    }
+    os << "LF:" << lines.size() << "\nLH:" << hit_lines << "\n";
+    os << "end_of_record\n";
+  }
+
+  /// taken/not-taken counts of every condition, keyed by its line and column
+  void writeBranchBias(llvm::raw_ostream &os) const {
+    llvm::json::OStream json(os, 2);
+    json.array([&] {
+      for (const BranchSite &site : mBranchOrder_) {
+        const BranchCounts &counts = mBranches_.find(site.mStmt_)->second;
+        uint64_t total = counts.mTaken_ + counts.mNotTaken_;
+        json.object([&] {
+          json.attribute("line", int64_t(line(site.mStmt_)));
+          json.attribute("column", int64_t(mSM_.getExpansionColumnNumber(site.mStmt_->getBeginLoc())));
+          json.attribute("kind", site.mKind_);
+          json.attribute("taken", int64_t(counts.mTaken_));
+          json.attribute("not_taken", int64_t(counts.mNotTaken_));
+          if (total) {
+            json.attribute("bias", double(counts.mTaken_) / total);
+          } else {
+            json.attribute("bias", nullptr);
+          }
+        });
+      }
+    });
+    os << "\n";
+  }
+
+ private:
+  struct Function {
+    FunctionDecl *mDecl_;
+    Stmt *mBody_;
+  };
+
+  struct BranchSite {
+    Stmt *mStmt_;
+    const char *mKind_;
+  };
+
+  struct BranchCounts {
+    uint64_t mTaken_ = 0;
+    uint64_t mNotTaken_ = 0;
+  };
+
+  bool inMainFile(Stmt *stmt) const { return mSM_.isInMainFile(mSM_.getExpansionLoc(stmt->getBeginLoc())); }
+
+  unsigned line(Stmt *stmt) const { return mSM_.getExpansionLineNumber(stmt->getBeginLoc()); }
+
+  /// a statement the interpreter visits on its own; blocks are counted through their statements
+  void addStmt(Stmt *stmt) {
+    if (!stmt || isa<CompoundStmt>(stmt) || !inMainFile(stmt) || mCounts_.count(stmt)) {
+      return;
+    }
+    mCounts_[stmt] = 0;
+    mStmts_.push_back(stmt);
+  }
+
+  void addBranch(Stmt *stmt, const char *kind) {
+    if (inMainFile(stmt)) {
+      mBranches_[stmt];
+      mBranchOrder_.push_back({stmt, kind});
+    }
+  }
+
+  const SourceManager &mSM_;
+  llvm::DenseMap<Stmt *, uint64_t> mCounts_;
+  std::vector<Stmt *> mStmts_;
+  std::vector<Function> mFunctions_;
+  llvm::DenseMap<Stmt *, BranchCounts> mBranches_;
+  std::vector<BranchSite> mBranchOrder_;
+};
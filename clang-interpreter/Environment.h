@@ -1,4 +1,8 @@
+#pragma once
+
 #include <stdio.h>
+#include <algorithm>
+#include <cstring>
 #include <exception>
 #include <vector>
 
@@ -8,17 +12,34 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MathExtras.h"
+
+#include "Builtins.h"
+#include "LoopOptimizer.h"
+#include "SuperInstructions.h"
+#include "Trace.h"
+#include "TypeFacts.h"
 
 using namespace clang;
 
 class StackFrame {
  private:
-  std::map<Decl *, int> mVars_;
-  std::map<Stmt *, int> mExprs_;
-  Stmt *mPC_;
+  llvm::DenseMap<Decl *, int> mVars_;
+  llvm::DenseMap<Stmt *, int> mExprs_;
+  Stmt *mPC_ = nullptr;
 
  public:
   StackFrame() = default;
+  /// a frame sized for its function up front, so binding its values never rehashes
+  StackFrame(unsigned numDecls, unsigned numStmts) {
+    mVars_.reserve(numDecls);
+    mExprs_.reserve(numStmts);
+  }
+
+  const llvm::DenseMap<Decl *, int> &getDecls() const { return mVars_; }
+  const llvm::DenseMap<Stmt *, int> &getStmts() const { return mExprs_; }
 
   bool hasDecl(Decl *decl) { return mVars_.find(decl) != mVars_.end(); }
 
@@ -29,6 +50,13 @@ class StackFrame {
     return mVars_.find(decl)->second;
   }
 
+  /// the storage of a bound decl, valid until the next decl is bound
+  int &getDeclSlot(Decl *decl) {
+    auto it = mVars_.find(decl);
+    assert(it != mVars_.end());
+    return it->second;
+  }
+
   bool hasStmt(Stmt *stmt) { return mExprs_.find(stmt) != mExprs_.end(); }
 
   void bindStmt(Stmt *stmt, int val) { mExprs_[stmt] = val; }
@@ -47,35 +75,101 @@ class StackFrame {
   Stmt *getPC() { return mPC_; }
 };
 
+/// Allocation counters of a Heap, HeapReport.h turns them into the end-of-run report
+struct HeapStats {
+  static const int kNumBuckets = 32;
+
+  uint64_t mAllocs_ = 0;
+  uint64_t mFrees_ = 0;
+  uint64_t mInvalidFrees_ = 0;  /// FREE of an address that is not the start of a live allocation
+  uint64_t mBytesAllocated_ = 0;
+  uint64_t mBytesFreed_ = 0;
+  uint64_t mLiveBytes_ = 0;
+  uint64_t mPeakLiveBytes_ = 0;
+  uint64_t mSizeHistogram_[kNumBuckets] = {};  /// bucket i counts the sizes in (2^(i-1), 2^i]
+};
+
+/// a heap access or allocation the program got wrong, the message is printed
+/// where it is thrown and the run stops
+class HeapError : public std::exception {};
+
 class Heap {
  public:
   using HeapAddr = int;
 
+  /// a live allocation and the MALLOC call that made it
+  struct Allocation {
+    int mSize_;
+    Stmt *mSite_;
+  };
+
  private:
   static const HeapAddr kInitHeapSize = sizeof(int) * 1024;
 
   void *mHeapPtr_;
   HeapAddr mOffset_;
 
-  inline int *actualAddr(HeapAddr addr) {
-    assert(addr <= kInitHeapSize);
-    return (int *)((char *)mHeapPtr_ + addr);
+  HeapStats mStats_;
+  llvm::DenseMap<HeapAddr, Allocation> mLive_;
+
+  void track(HeapAddr addr, int size, Stmt *site) {
+    mLive_[addr] = {size, site};
+    mStats_.mLiveBytes_ += size;
+    mStats_.mPeakLiveBytes_ = std::max(mStats_.mPeakLiveBytes_, mStats_.mLiveBytes_);
+  }
+
+  inline int *actualAddr(HeapAddr addr) { return (int *)actualRange(addr, sizeof(int)); }
+
+  /// the program picks the addresses and sizes, so this is checked in every build
+  /// against the allocated prefix
+  inline char *actualRange(HeapAddr addr, int64_t size) {
+    if (addr < 0 || size < 0 || addr + size > mOffset_) {
+      llvm::outs() << "heap access out of bounds: address " << addr << " size " << size
+                   << ", allocated " << mOffset_ << "\n";
+      throw HeapError();
+    }
+    return (char *)mHeapPtr_ + addr;
   }
 
  public:
   Heap() : mHeapPtr_(malloc(kInitHeapSize)), mOffset_(0) {}
   ~Heap() { free(mHeapPtr_); }
 
-  HeapAddr Malloc(int size) {
+  HeapAddr Malloc(int size, Stmt *site = nullptr) {
+    if (size < 0 || size > kInitHeapSize - mOffset_) {
+      llvm::outs() << "cannot allocate size: " << size << " still have: " << kInitHeapSize - mOffset_ << "\n";
+      throw HeapError();
+    }
     HeapAddr start = mOffset_;
     mOffset_ += size;
     llvm::outs() << "allocate size: " << size << " return address: " << start
                  << " still have: " << kInitHeapSize - mOffset_ << "\n";
-    assert(mOffset_ <= kInitHeapSize);
+
+    mStats_.mAllocs_++;
+    mStats_.mBytesAllocated_ += size;
+    mStats_.mSizeHistogram_[std::min<int>(llvm::Log2_32_Ceil(std::max(size, 1)), HeapStats::kNumBuckets - 1)]++;
+    track(start, size, site);
     return start;
   }
 
-  void Free(HeapAddr addr) {}
+  /// the memory is not reused, but the allocation stops counting as live
+  void Free(HeapAddr addr) {
+    auto it = mLive_.find(addr);
+    if (it == mLive_.end()) {
+      mStats_.mInvalidFrees_++;
+      return;
+    }
+    mStats_.mFrees_++;
+    mStats_.mBytesFreed_ += it->second.mSize_;
+    mStats_.mLiveBytes_ -= it->second.mSize_;
+    mLive_.erase(it);
+  }
+
+  const HeapStats &getStats() const { return mStats_; }
+  const llvm::DenseMap<HeapAddr, Allocation> &getLiveAllocations() const { return mLive_; }
+
+  /// re-registers a live allocation when a snapshot is restored
+  void restoreAllocation(HeapAddr addr, int size, Stmt *site) { track(addr, size, site); }
 
   void Update(HeapAddr addr, int val) {
     int *ptr = actualAddr(addr);
@@ -88,6 +182,36 @@ class Heap {
     return *ptr;
   }
 
+  /// the heap cell at `addr`, for in-place updates
+  int &at(HeapAddr addr) { return *(int *)actualRange(addr, sizeof(int)); }
+
+  /// bulk operations for the native builtins, addresses and sizes are in bytes
+  void copy(HeapAddr dst, HeapAddr src, int size) { memmove(actualRange(dst, size), actualRange(src, size), size); }
+
+  void fill(HeapAddr dst, int val, int size) { memset(actualRange(dst, size), val, size); }
+
+  /// `count` ints starting at `addr`, valid until the next Malloc
+  llvm::MutableArrayRef<int> ints(HeapAddr addr, int count) {
+    return llvm::MutableArrayRef<int>((int *)actualRange(addr, int64_t(count) * int64_t(sizeof(int))), count);
+  }
+
+  /// the allocated prefix of the heap, used by snapshots
+  llvm::StringRef getContents() const { return llvm::StringRef((const char *)mHeapPtr_, mOffset_); }
+
+  /// false, leaving the heap alone, if `contents` does not fit
+  bool setContents(llvm::StringRef contents) {
+    if (contents.size() > getCapacity()) {
+      return false;
+    }
+    memcpy(mHeapPtr_, contents.data(), contents.size());
+    mOffset_ = contents.size();
+    mLive_.clear();
+    mStats_ = HeapStats();
+    return true;
+  }
+
+  static uint64_t getCapacity() { return kInitHeapSize; }
+
   static int getPtrSize() { return sizeof(HeapAddr); }
 
   static int step2Size(int step) { return step * getPtrSize(); }
@@ -109,6 +233,7 @@ class Array {
 
  public:
   Array(int sz, int scope) : mArr_(sz), mScope_(scope) {}
+  Array(std::vector<int> arr, int scope) : mArr_(std::move(arr)), mScope_(scope) {}
   void set(int i, int val) {
     assert(i <= mArr_.size());
     mArr_[i] = val;
@@ -117,6 +242,47 @@ class Array {
     assert(i <= mArr_.size());
     return mArr_[i];
   }
+  int &at(int i) {
+    assert(i < mArr_.size());
+    return mArr_[i];
+  }
+  int getScope() const { return mScope_; }
+  const std::vector<int> &getValues() const { return mArr_; }
+};
+
+/// Number of declarations and expressions of a function body, i.e. the sizes a frame of it needs
+class FrameLayout : public RecursiveASTVisitor<FrameLayout> {
+ public:
+  explicit FrameLayout(FunctionDecl *fdecl) : mNumDecls_(fdecl->getNumParams()), mNumStmts_(0) {
+    TraverseStmt(fdecl->getBody());
+  }
+
+  bool VisitVarDecl(VarDecl *) {
+    mNumDecls_++;
+    return true;
+  }
+
+  bool VisitExpr(Expr *) {
+    mNumStmts_++;
+    return true;
+  }
+
+  unsigned getNumDecls() const { return mNumDecls_; }
+  unsigned getNumStmts() const { return mNumStmts_; }
+
+ private:
+  unsigned mNumDecls_;
+  unsigned mNumStmts_;
+};
+
+/// What a call site resolved to the first time it ran
+struct CallSite {
+  const Builtin *mBuiltin_;  /// null for user functions
+  FunctionDecl *mCallee_;    /// the definition for user functions
+  Stmt *mBody_;
+  llvm::SmallVector<ParmVarDecl *, 4> mParams_;
+  unsigned mNumDecls_;
+  unsigned mNumStmts_;
 };
 
 class InterpreterVisitor;
@@ -129,15 +295,54 @@ class Environment {
   std::vector<StackFrame> mStack_;
   std::vector<Array> mArrays_;
 
-  FunctionDecl *mFree_;  /// Declartions to the built-in functions
-  FunctionDecl *mMalloc_;
-  FunctionDecl *mGet_;
-  FunctionDecl *mPrint_;
+  BuiltinRegistry mRegistry_;
+  /// Declartions to the built-in functions
+  llvm::DenseMap<FunctionDecl *, const Builtin *> mBuiltins_;
+  Trace *mTrace_ = nullptr;  /// records or replays the builtin calls
 
   FunctionDecl *mEntry_;
 
+  bool mCheckpointRequested_ = false;
+
+  SuperInstructions mSuper_;
+  TypeFacts mFacts_;
+
+  llvm::DenseMap<CallExpr *, CallSite> mCallSites_;
+
+  LoopOptimizer mLoops_;
+  /// values of the hoisted and strided expressions of the loops being executed
+  llvm::DenseMap<Stmt *, int> mLoopValues_;
+
  public:
   void setInterpreter(EvaluatedExprVisitor<InterpreterVisitor> *visitor) { this->mInterpreter_ = visitor; }
+
+  /// raw state, used to take and restore snapshots
+  std::vector<StackFrame> &getStack() { return mStack_; }
+  std::vector<Array> &getArrays() { return mArrays_; }
+  Heap &getHeap() { return mHeap_; }
+
+  /// native functions, must be registered before `init`
+  BuiltinRegistry &getBuiltins() { return mRegistry_; }
+
+  void setTrace(Trace *trace) { mTrace_ = trace; }
+
+  /// the builtin an extern function declaration is bound to, null for other functions
+  const Builtin *getBuiltin(FunctionDecl *fdecl) const { return mBuiltins_.lookup(fdecl); }
+
+  /// runs a builtin, through the trace when recording or replaying
+  int callBuiltin(const Builtin &builtin, llvm::ArrayRef<int> args) {
+    return mTrace_ ? mTrace_->call(*this, builtin, args) : builtin.mFn_(*this, args);
+  }
+
+  /// set by `CHECKPOINT()`, the snapshot is taken at the next statement boundary of main
+  void requestCheckpoint() { mCheckpointRequested_ = true; }
+
+  bool takeCheckpointRequest() {
+    bool requested = mCheckpointRequested_;
+    mCheckpointRequested_ = false;
+    return requested;
+  }
+
   void stackPop() { mStack_.pop_back(); }
 
   StackFrame &stackTop() { return mStack_.back(); }
@@ -164,34 +369,130 @@ class Environment {
     return globalScope().getDeclVal(decl);
   }
 
+  int &getDeclSlot(Decl *decl) {
+    return stackTop().hasDecl(decl) ? stackTop().getDeclSlot(decl) : globalScope().getDeclSlot(decl);
+  }
+
+  /// the variable, array element or heap cell `expr` designates, the subexpressions of `expr`
+  /// must have been evaluated; null if the lvalue is not supported
+  int *lvalue(Expr *expr) {
+    expr = expr->IgnoreParens();
+    if (auto *declexpr = dyn_cast<DeclRefExpr>(expr)) {
+      return &getDeclSlot(declexpr->getFoundDecl());
+    }
+    if (auto *arrsub = dyn_cast<ArraySubscriptExpr>(expr)) {
+      return &getArray(arrsub).at(getArrayIdx(arrsub));
+    }
+    auto *uop = dyn_cast<UnaryOperator>(expr);
+    if (uop && uop->getOpcode() == UO_Deref) {
+      return &mHeap_.at(stackTop().getStmtVal(uop->getSubExpr()));
+    }
+    return nullptr;
+  }
+
   void bindStmt(Stmt *stmt, int val) { stackTop().bindStmt(stmt, val); }
 
   int getStmtVal(Stmt *stmt) { return stackTop().getStmtVal(stmt); }
 
   static const int kScH001 = 11217991;
   /// Get the declartions to the built-in functions
-  Environment() : mFree_(nullptr), mMalloc_(nullptr), mGet_(nullptr), mPrint_(nullptr), mEntry_(nullptr) {}
+  Environment() : mEntry_(nullptr) {}
 
   void init(TranslationUnitDecl *unit) {
+    mFacts_.build(unit);
     mStack_.push_back(StackFrame());
     for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i) {
       if (auto *fdecl = dyn_cast<FunctionDecl>(*i)) {
-        if (fdecl->getName().equals("FREE")) {
-          mFree_ = fdecl;
-        } else if (fdecl->getName().equals("MALLOC")) {
-          mMalloc_ = fdecl;
-        } else if (fdecl->getName().equals("GET")) {
-          mGet_ = fdecl;
-        } else if (fdecl->getName().equals("PRINT")) {
-          mPrint_ = fdecl;
-        } else if (fdecl->getName().equals("main")) {
+        if (fdecl->getName().equals("main")) {
           mEntry_ = fdecl;
+        } else if (!fdecl->hasBody()) {
+          bindBuiltin(fdecl);
         }
       } else if (auto *vdecl = dyn_cast<VarDecl>(*i)) {
         /// global variable?
         this->handleVarDecl(vdecl);
       }
     }
+    mSuper_.build(unit);
+    mLoops_.build(unit);
+  }
+
+  /// binds an extern function to the native builtin of its name, if there is one that fits
+  void bindBuiltin(FunctionDecl *fdecl) {
+    const Builtin *builtin = mRegistry_.lookup(fdecl->getName());
+    if (!builtin) {
+      return;
+    }
+    bool returns_value = !fdecl->getReturnType()->isVoidType();
+    if (fdecl->getNumParams() != builtin->mNumParams_ || returns_value != builtin->mReturnsValue_) {
+      llvm::outs() << "the declaration of " << fdecl->getName() << " does not match its builtin\n";
+      return;
+    }
+    mBuiltins_[fdecl] = builtin;
+  }
+
+  const SuperInstructions &getSuperInstructions() const { return mSuper_; }
+  const LoopOptimizer &getLoopOptimizer() const { return mLoops_; }
+
+  /// binds `stmt` from the loop values instead of evaluating it, returns false if it has none
+  bool bindLoopValue(Stmt *stmt) {
+    if (mLoopValues_.empty()) {
+      return false;
+    }
+    auto it = mLoopValues_.find(stmt);
+    if (it == mLoopValues_.end()) {
+      return false;
+    }
+    stackTop().bindStmt(stmt, it->second);
+    mLoops_.countReuse();
+    return true;
+  }
+
+  /// a loop value shadowed by a recursive activation of the same loop
+  struct SavedLoopValue {
+    Stmt *mStmt_;
+    bool mPresent_;
+    int mVal_;
+  };
+
+  /// evaluates the invariant and strided expressions of `fstmt` once, returns the loop's plan
+  const LoopPlan *enterLoop(ForStmt *fstmt, llvm::SmallVectorImpl<SavedLoopValue> &saved) {
+    const LoopPlan *plan = mLoops_.lookup(fstmt);
+    if (!plan) {
+      return nullptr;
+    }
+    auto evaluate = [&](Expr *expr) {
+      mInterpreter_->Visit(expr);
+      int val = getStmtVal(expr);
+      auto it = mLoopValues_.find(expr);
+      bool present = it != mLoopValues_.end();
+      saved.push_back({expr, present, present ? it->second : 0});
+      mLoopValues_[expr] = val;
+    };
+    for (Expr *expr : plan->mInvariants_) {
+      evaluate(expr);
+    }
+    for (const LoopPlan::Stride &stride : plan->mStrides_) {
+      evaluate(stride.mExpr_);
+    }
+    return plan;
+  }
+
+  /// advances the strided expressions after the loop increment ran
+  void stepLoop(const LoopPlan *plan) {
+    for (const LoopPlan::Stride &stride : plan->mStrides_) {
+      mLoopValues_[stride.mExpr_] += stride.mScaled_ ? Heap::step2Size(stride.mDelta_) : stride.mDelta_;
+    }
+  }
+
+  void leaveLoop(llvm::ArrayRef<SavedLoopValue> saved) {
+    for (auto it = saved.rbegin(), ie = saved.rend(); it != ie; ++it) {
+      if (it->mPresent_) {
+        mLoopValues_[it->mStmt_] = it->mVal_;
+      } else {
+        mLoopValues_.erase(it->mStmt_);
+      }
+    }
   }
 
   FunctionDecl *getEntry() { return mEntry_; }
@@ -214,6 +515,22 @@ class Environment {
       case UO_Deref:
         val = mHeap_.get(val);
         break;
+      case UO_PreInc:
+      case UO_PostInc:
+      case UO_PreDec:
+      case UO_PostDec: {
+        int *slot = lvalue(uop->getSubExpr());
+        if (!slot) {
+          llvm::outs() << "below increment/decrement operand is not supported\n";
+          uop->getSubExpr()->dump();
+          break;
+        }
+        int step = mFacts_.get(uop) == OpKind::PtrStep ? Heap::step2Size(1) : 1;
+        int old = *slot;
+        *slot = uop->isIncrementOp() ? old + step : old - step;
+        val = uop->isPrefix() ? *slot : old;
+        break;
+      }
       default:
         llvm::outs() << "Below uop is not supported: \n";
         uop->dump();
@@ -222,28 +539,21 @@ class Environment {
     stackTop().bindStmt(uop, val);
   }
 
-  int handleAdditive(int opCode, Expr *left, Expr *right, int lval, int rval) {
-    /// handle
-    auto ltype = left->getType();
-    auto rtype = right->getType();
-    bool l_is_ptr = ltype->isPointerType();
-    bool r_is_ptr = rtype->isPointerType();
-    if (l_is_ptr && r_is_ptr) {
-      assert(opCode == BO_Sub);
-      return (lval - rval) / Heap::getPtrSize();
-    }
-
-    if (l_is_ptr) {
-      rval = Heap::step2Size(rval);
-    } else if (r_is_ptr) {
-      lval = Heap::step2Size(lval);
-    }
-
-    if (opCode == BO_Add) {
-      return lval + rval;
+  static int handleAdditive(OpKind kind, int lval, int rval) {
+    switch (kind) {
+      case OpKind::PtrSubPtr:
+        return (lval - rval) / Heap::getPtrSize();
+      case OpKind::PtrAddInt:
+        return lval + Heap::step2Size(rval);
+      case OpKind::IntAddPtr:
+        return Heap::step2Size(lval) + rval;
+      case OpKind::PtrSubInt:
+        return lval - Heap::step2Size(rval);
+      case OpKind::IntSub:
+        return lval - rval;
+      default:
+        return lval + rval;
     }
-
-    return lval - rval;
   }
 
   void binop(BinaryOperator *bop) {
@@ -254,7 +564,19 @@ class Environment {
 
     auto op_code = bop->getOpcode();
     int res = 0;
-    if (bop->isAssignmentOp()) {
+    if (bop->isCompoundAssignmentOp()) {
+      /// read-modify-write of the slot, the LHS is not re-bound
+      int *slot = lvalue(left);
+      if (!slot) {
+        llvm::outs() << "below assignment(LHS) is not supported\n";
+        left->dump();
+        return;
+      }
+      auto arith_op = TypeFacts::arithmeticOp(bop);
+      *slot = BinaryOperator::isAdditiveOp(arith_op) ? handleAdditive(mFacts_.get(bop), *slot, rval)
+                                                     : arithmetic(arith_op, *slot, rval);
+      stackTop().bindStmt(bop, *slot);
+    } else if (bop->isAssignmentOp()) {
       stackTop().bindStmt(left, rval);
       stackTop().bindStmt(bop, rval);
 
@@ -277,39 +599,15 @@ class Environment {
       }
     } else if (bop->isAdditiveOp()) {
       int lval = stackTop().getStmtVal(left);
-      res = handleAdditive(op_code, left, right, lval, rval);
+      res = handleAdditive(mFacts_.get(bop), lval, rval);
       stackTop().bindStmt(bop, res);
-    } else if (bop->isMultiplicativeOp()) {
+    } else if (bop->isMultiplicativeOp() || bop->isShiftOp() || bop->isBitwiseOp()) {
       int lval = stackTop().getStmtVal(left);
-      if (op_code == BO_Mul) {
-        res = lval * rval;
-      } else {
-        res = lval % rval;
-      }
+      res = arithmetic(op_code, lval, rval);
       stackTop().bindStmt(bop, res);
     } else if (bop->isComparisonOp()) {
       int lval = stackTop().getStmtVal(left);
-      int val = kScH001;
-      switch (op_code) {
-        case BO_LT:
-          val = (lval < rval);
-          break;
-        case BO_GT:
-          val = (lval > rval);
-          break;
-        case BO_LE:
-          val = (lval <= rval);
-          break;
-        case BO_GE:
-          val = (lval >= rval);
-          break;
-        case BO_EQ:
-          val = (lval == rval);
-          break;
-        case BO_NE:
-          val = (lval != rval);
-          break;
-      }
+      int val = compare(op_code, lval, rval);
       // llvm::outs() << "op: " << op << "val " << val << "\n";
       stackTop().bindStmt(bop, val);
     }
@@ -320,6 +618,90 @@ class Environment {
     }
   }
 
+  /// the non-additive arithmetic ops, shared by `a op b` and `a op= b`
+  static int arithmetic(BinaryOperatorKind op_code, int lval, int rval) {
+    switch (op_code) {
+      case BO_Mul:
+        return lval * rval;
+      case BO_Div:
+        return lval / rval;
+      case BO_Rem:
+        return lval % rval;
+      case BO_Shl:
+        return lval << rval;
+      case BO_Shr:
+        return lval >> rval;
+      case BO_And:
+        return lval & rval;
+      case BO_Or:
+        return lval | rval;
+      case BO_Xor:
+        return lval ^ rval;
+      default:
+        return kScH001;
+    }
+  }
+
+  static int compare(BinaryOperatorKind op_code, int lval, int rval) {
+    switch (op_code) {
+      case BO_LT:
+        return lval < rval;
+      case BO_GT:
+        return lval > rval;
+      case BO_LE:
+        return lval <= rval;
+      case BO_GE:
+        return lval >= rval;
+      case BO_EQ:
+        return lval == rval;
+      case BO_NE:
+        return lval != rval;
+      default:
+        return kScH001;
+    }
+  }
+
+  /// executes `expr` as a superinstruction, returns false if it has no fused form
+  bool fused(Expr *expr) {
+    const FusedOp *op = mSuper_.lookup(expr);
+    if (!op) {
+      return false;
+    }
+    mSuper_.count(op->mKind_);
+    int val = 0;
+    switch (op->mKind_) {
+      case FusedKind::CmpConst:
+        val = compare(op->mOp_, getDeclVal(op->mVar_), op->mImm_);
+        break;
+      case FusedKind::UpdateVar: {
+        int rval = op->mOperand_ ? getDeclVal(op->mOperand_) : op->mImm_;
+        int &slot = getDeclSlot(op->mVar_);
+        int old = slot;
+        slot = op->mOp_ == BO_Add ? old + rval : op->mOp_ == BO_Sub ? old - rval : old * rval;
+        val = op->mPostfix_ ? old : slot;
+        break;
+      }
+      case FusedKind::ArrayStore: {
+        mInterpreter_->Visit(op->mValue_);
+        val = getStmtVal(op->mValue_);
+        int idx = op->mOperand_ ? getDeclVal(op->mOperand_) : op->mImm_;
+        int arrayID = getDeclVal(op->mVar_);
+        assert(arrayID < mArrays_.size());
+        mArrays_[arrayID].set(idx, val);
+        break;
+      }
+      case FusedKind::DerefStore:
+        mInterpreter_->Visit(op->mValue_);
+        val = getStmtVal(op->mValue_);
+        mHeap_.Update(getDeclVal(op->mVar_), val);
+        break;
+      default:
+        return false;
+    }
+    stackTop().bindStmt(expr, val);
+    return true;
+  }
+
   void parm(ParmVarDecl *parmdecl, int val) { stackTop().bindDecl(parmdecl, val); }
   /// use by global & local
   void handleVarDecl(VarDecl *vardecl) {
@@ -372,83 +754,83 @@ class Environment {
     stackTop().bindStmt(arrsubexpr, res);
   }
 
-  static bool isValidDeclRefType(DeclRefExpr *declref) {
-    auto tp = declref->getType();
-    return tp->isIntegerType() || tp->isArrayType() || tp->isPointerType();
-  }
-
-  bool isBuiltInDecl(DeclRefExpr *declref) {
-    const Decl *decl = declref->getReferencedDeclOfCallee();
-    return declref->getType()->isFunctionType() &&
-           (decl == mGet_ || decl == mPrint_ || decl == mMalloc_ || decl == mFree_);
-  }
-
   void declref(DeclRefExpr *declref) {
     stackTop().setPC(declref);
-    if (isValidDeclRefType(declref)) {
-      Decl *decl = declref->getFoundDecl();
-
-      int val = this->getDeclVal(decl);
-      stackTop().bindStmt(declref, val);
-    } else if (!isBuiltInDecl(declref) && !declref->getType()->isFunctionType()) {
-      llvm::outs() << "below declref is not supported:\n";
-      declref->dump();
+    switch (mFacts_.get(declref)) {
+      case OpKind::ValueRef:
+        stackTop().bindStmt(declref, this->getDeclVal(declref->getFoundDecl()));
+        break;
+      case OpKind::FunctionRef:
+        /// builtins and user functions are resolved by the CallExpr
+        break;
+      default:
+        llvm::outs() << "below declref is not supported:\n";
+        declref->dump();
+        break;
     }
   }
 
   void cast(CastExpr *castexpr) {
     stackTop().setPC(castexpr);
-    if (castexpr->getType()->isIntegerType()) {
+    if (mFacts_.get(castexpr) == OpKind::IntCast) {
       Expr *expr = castexpr->getSubExpr();
       int val = stackTop().getStmtVal(expr);
       stackTop().bindStmt(castexpr, val);
     }
   }
 
+  /// the callee, and for user functions the parameters and frame size, are static per call site
+  const CallSite &resolveCall(CallExpr *callexpr) {
+    auto it = mCallSites_.find(callexpr);
+    if (it != mCallSites_.end()) {
+      return it->second;
+    }
+
+    CallSite site = {};
+    FunctionDecl *callee = callexpr->getDirectCallee();
+    site.mCallee_ = callee;
+    site.mBuiltin_ = mBuiltins_.lookup(callee);
+    if (!site.mBuiltin_) {
+      /// the body refers to the parameters of the definition, not of a prior declaration
+      FunctionDecl *def = callee->getDefinition();
+      assert(def && "call to a function without a body");
+      site.mCallee_ = def;
+      site.mBody_ = def->getBody();
+      site.mParams_.assign(def->param_begin(), def->param_end());
+      FrameLayout layout(def);
+      site.mNumDecls_ = layout.getNumDecls();
+      site.mNumStmts_ = layout.getNumStmts();
+    }
+    return mCallSites_[callexpr] = std::move(site);
+  }
+
+  /// a builtin runs to completion here, for a user function the callee's frame is pushed and
+  /// true is returned so that the visitor runs its body
   bool call(CallExpr *callexpr) {
-    bool not_builtin = false;
     stackTop().setPC(callexpr);
-    int val = 0;
-    FunctionDecl *callee = callexpr->getDirectCallee();
-    if (callee == mGet_) {
-      llvm::outs() << "please input an integer value: ";
-      scanf("%d", &val);
-      stackTop().bindStmt(callexpr, val);
-    } else if (callee == mPrint_) {
-      Expr *decl = callexpr->getArg(0);
-      val = stackTop().getStmtVal(decl);
-      llvm::errs() << val;
-    } else if (callee == mMalloc_) {
-      Expr *decl = callexpr->getArg(0);
-      val = stackTop().getStmtVal(decl);
-      int addr = mHeap_.Malloc(val);
-      stackTop().bindStmt(callexpr, addr);
-    } else if (callee == mFree_) {
-      Expr *decl = callexpr->getArg(0);
-      val = stackTop().getStmtVal(decl);
-      mHeap_.Free(val);
-    } else {
-      // llvm::outs() << "function call\n";
-      not_builtin = true;
-      /// first we get the arguments from caller frame
-      std::vector<int> args;
-      Expr **expr_list = callexpr->getArgs();
-      for (int i = 0; i < callexpr->getNumArgs(); i++) {
-        int val = stackTop().getStmtVal(expr_list[i]);
-        args.push_back(val);
-      }
+    const CallSite &site = resolveCall(callexpr);
+    /// first we get the arguments from caller frame
+    llvm::SmallVector<int, 8> args;
+    for (Expr *arg : callexpr->arguments()) {
+      args.push_back(stackTop().getStmtVal(arg));
+    }
 
-      /// You could add your code here for Function call Return
-      mStack_.emplace_back(StackFrame());  // push frame
-      // define parameter list
-      assert(callee->getNumParams() == callexpr->getNumArgs());
-      for (int i = 0; i < callee->getNumParams(); i++) {
-        this->parm(callee->getParamDecl(i), args[i]);
+    if (const Builtin *builtin = site.mBuiltin_) {
+      int val = callBuiltin(*builtin, args);
+      if (builtin->mReturnsValue_) {
+        stackTop().bindStmt(callexpr, val);
       }
+      return false;
+    }
 
-      stackTop().setPC(callee->getBody());
+    assert(site.mParams_.size() == args.size());
+    mStack_.emplace_back(site.mNumDecls_, site.mNumStmts_);  // push a frame sized for the callee
+    for (unsigned i = 0; i < args.size(); i++) {
+      this->parm(site.mParams_[i], args[i]);
     }
-    return not_builtin;
+
+    stackTop().setPC(site.mBody_);
+    return true;
   }
 
   void retrn(ReturnStmt *retstmt) {
@@ -457,4 +839,22 @@ class Environment {
     // llvm::outs() << "return val: " << val << "\n";
     throw ReturnException(val);
   }
-};
\ No newline at end of file
+};
+
+/// Applies the LoopPlan of a `for` loop while the loop runs, also when it is left by a `return`
+class LoopScope {
+ public:
+  LoopScope(Environment &env, ForStmt *fstmt) : mEnv_(env), mPlan_(env.enterLoop(fstmt, mSaved_)) {}
+  ~LoopScope() { mEnv_.leaveLoop(mSaved_); }
+
+  void step() {
+    if (mPlan_) {
+      mEnv_.stepLoop(mPlan_);
+    }
+  }
+
+ private:
+  Environment &mEnv_;
+  llvm::SmallVector<Environment::SavedLoopValue, 8> mSaved_;
+  const LoopPlan *mPlan_;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "clang/Basic/SourceManager.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Environment.h"
+
+using namespace clang;
+
+/// End-of-run report over the counters and live allocations of a Heap. Allocations that are
+/// still live when the program exits are reported with the MALLOC call that made them.
+class HeapReport {
+ public:
+  HeapReport(const Heap &heap, const SourceManager &sm) : mStats_(heap.getStats()), mSM_(sm) {
+    for (const auto &entry : heap.getLiveAllocations()) {
+      mOutstanding_.push_back({entry.first, entry.second});
+    }
+    std::sort(mOutstanding_.begin(), mOutstanding_.end(),
+              [](const Outstanding &a, const Outstanding &b) { return a.mAddr_ < b.mAddr_; });
+  }
+
+  void print(llvm::raw_ostream &os) const {
+    os << "heap: " << mStats_.mAllocs_ << " allocations, " << mStats_.mBytesAllocated_ << " bytes allocated, "
+       << mStats_.mBytesFreed_ << " bytes freed, " << mStats_.mPeakLiveBytes_ << " bytes peak\n";
+    for (int i = 0; i < HeapStats::kNumBuckets; i++) {
+      if (mStats_.mSizeHistogram_[i]) {
+        os << "  <= " << (uint64_t(1) << i) << " bytes: " << mStats_.mSizeHistogram_[i] << "\n";
+      }
+    }
+    if (mStats_.mInvalidFrees_) {
+      os << "  " << mStats_.mInvalidFrees_ << " invalid FREE(s)\n";
+    }
+    for (const Outstanding &out : mOutstanding_) {
+      os << "  leaked " << out.mAlloc_.mSize_ << " bytes at " << out.mAddr_ << " allocated at "
+         << location(out.mAlloc_.mSite_) << "\n";
+    }
+  }
+
+  void writeJSON(llvm::raw_ostream &os) const {
+    llvm::json::OStream json(os, 2);
+    json.object([&] {
+      json.attribute("allocations", int64_t(mStats_.mAllocs_));
+      json.attribute("frees", int64_t(mStats_.mFrees_));
+      json.attribute("invalid_frees", int64_t(mStats_.mInvalidFrees_));
+      json.attribute("bytes_allocated", int64_t(mStats_.mBytesAllocated_));
+      json.attribute("bytes_freed", int64_t(mStats_.mBytesFreed_));
+      json.attribute("live_bytes", int64_t(mStats_.mLiveBytes_));
+      json.attribute("peak_live_bytes", int64_t(mStats_.mPeakLiveBytes_));
+      json.attributeArray("size_histogram", [&] {
+        for (int i = 0; i < HeapStats::kNumBuckets; i++) {
+          if (mStats_.mSizeHistogram_[i]) {
+            json.object([&] {
+              json.attribute("max_size", int64_t(1) << i);
+              json.attribute("count", int64_t(mStats_.mSizeHistogram_[i]));
+            });
+          }
+        }
+      });
+      json.attributeArray("outstanding", [&] {
+        for (const Outstanding &out : mOutstanding_) {
+          json.object([&] {
+            json.attribute("address", out.mAddr_);
+            json.attribute("size", out.mAlloc_.mSize_);
+            json.attribute("location", location(out.mAlloc_.mSite_));
+          });
+        }
+      });
+    });
+    os << "\n";
+  }
+
+ private:
+  struct Outstanding {
+    Heap::HeapAddr mAddr_;
+    Heap::Allocation mAlloc_;
+  };
+
+  std::string location(Stmt *site) const {
+    return site ? site->getBeginLoc().printToString(mSM_) : std::string("<unknown>");
+  }
+
+  const HeapStats &mStats_;
+  const SourceManager &mSM_;
+  std::vector<Outstanding> mOutstanding_;
+};
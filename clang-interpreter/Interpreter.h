@@ -0,0 +1,472 @@
+#pragma once
+
+#include "clang/AST/AST.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/EvaluatedExprVisitor.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Coverage.h"
+#include "Environment.h"
+#include "HeapReport.h"
+#include "NativeBuiltins.h"
+#include "Profiler.h"
+#include "RegMachine.h"
+#include "Snapshot.h"
+
+using namespace clang;
+
+class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor> {
+ public:
+  explicit InterpreterVisitor(const ASTContext &context, Environment *env) : EvaluatedExprVisitor(context), mEnv_(env) {
+    env->setInterpreter(this);
+  }
+
+  virtual ~InterpreterVisitor() = default;
+
+  void setCoverage(Coverage *coverage) { mCoverage_ = coverage; }
+  void setProfiler(Profiler *profiler) { mProfiler_ = profiler; }
+
+  /// runs a statement of a block, a branch or a loop body, the profiler's safepoint
+  void execute(Stmt *stmt) {
+    if (mCoverage_) {
+      mCoverage_->hit(stmt);
+    }
+    if (mProfiler_) {
+      mProfiler_->poll(*mEnv_, stmt);
+    }
+    this->Visit(stmt);
+  }
+
+  /// records which way a condition went when coverage is collected
+  int branch(Stmt *stmt, int cond) {
+    if (mCoverage_) {
+      mCoverage_->branch(stmt, cond);
+    }
+    return cond;
+  }
+
+  /// visits the children of an expression, except those whose value a loop already knows
+  void VisitChildren(Stmt *stmt) {
+    for (Stmt *child : stmt->children()) {
+      if (child && !mEnv_->bindLoopValue(child)) {
+        this->Visit(child);
+      }
+    }
+  }
+
+  /// evaluates a condition
+  int evaluate(Expr *expr) {
+    if (!mEnv_->bindLoopValue(expr)) {
+      this->Visit(expr);
+    }
+    return mEnv_->getStmtVal(expr);
+  }
+
+  virtual void VisitBinaryOperator(BinaryOperator *bop) {
+    bop->dump();
+    if (mEnv_->fused(bop)) {
+      return;
+    }
+    VisitChildren(bop);
+    mEnv_->binop(bop);
+  }
+
+  virtual void VisitUnaryOperator(UnaryOperator *uop) {
+    uop->dump();
+    if (mEnv_->fused(uop)) {
+      return;
+    }
+    VisitChildren(uop);
+    mEnv_->uop(uop);
+  }
+
+  virtual void VisitIntegerLiteral(IntegerLiteral *il) {
+    il->dump();
+    int val = il->getValue().getSExtValue();
+    mEnv_->bindStmt(il, val);
+  }
+
+  virtual void VisitDeclRefExpr(DeclRefExpr *expr) {
+    expr->dump();
+    VisitChildren(expr);
+    mEnv_->declref(expr);
+  }
+
+  virtual void VisitCastExpr(CastExpr *expr) {
+    expr->dump();
+    VisitChildren(expr);
+    mEnv_->cast(expr);
+  }
+
+  virtual void VisitCallExpr(CallExpr *call) {
+    call->dump();
+    VisitChildren(call);
+    bool not_builtin = mEnv_->call(call);
+    try {
+      if (not_builtin) {
+        execute(mEnv_->stackTop().getPC());
+      }
+    } catch (ReturnException &e) {
+      int ret_val = e.getRetVal();
+      mEnv_->stackPop();
+      mEnv_->stackTop().bindStmt(call, ret_val);
+    }
+  }
+
+  virtual void VisitDeclStmt(DeclStmt *declstmt) {
+    declstmt->dump();
+    mEnv_->decl(declstmt);
+  }
+
+  int getChildrenSize(Stmt *stmt) {
+    int i = 0;
+    for (auto *c : stmt->children()) {
+      i++;
+    }
+    return i;
+  }
+
+  virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *arrsubexpr) {
+    arrsubexpr->dump();
+    // llvm::outs() << "children size: " << getChildrenSize(arrsubexpr) << "\n";
+    VisitChildren(arrsubexpr);
+    mEnv_->arraysub(arrsubexpr);
+  }
+
+  virtual void VisitReturnStmt(ReturnStmt *retstmt) {
+    retstmt->dump();
+    VisitChildren(retstmt);
+    mEnv_->retrn(retstmt);
+  }
+
+  virtual void VisitCompoundStmt(CompoundStmt *cstmt) {
+    for (Stmt *stmt : cstmt->body()) {
+      execute(stmt);
+    }
+  }
+
+  virtual void VisitIfStmt(IfStmt *ifstmt) {
+    ifstmt->dump();
+    int cond = branch(ifstmt, evaluate(ifstmt->getCond()));
+    if (cond) {
+      // llvm::outs() << "then branch\n";
+      if (ifstmt->getThen()) {
+        execute(ifstmt->getThen());
+      }
+    } else {
+      if (ifstmt->getElse()) {
+        execute(ifstmt->getElse());
+      }
+      // llvm::outs() << "else branch\n";
+    }
+  }
+
+  virtual void VisitWhileStmt(WhileStmt *wstmt) {
+    wstmt->dump();
+    Expr *cond_expr = wstmt->getCond();
+    do {
+      int cond = branch(wstmt, evaluate(cond_expr));
+      if (!cond) {
+        break;
+      }
+      execute(wstmt->getBody());
+    } while (true);
+  }
+
+  virtual void VisitForStmt(ForStmt *fstmt) {
+    fstmt->dump();
+    Stmt *initstmt = fstmt->getInit();
+    if (initstmt) {
+      this->Visit(initstmt);
+    }
+    LoopScope scope(*mEnv_, fstmt);
+    Expr *cond_expr = fstmt->getCond();
+    do {
+      int cond = branch(fstmt, evaluate(cond_expr));
+      if (!cond) {
+        break;
+      }
+      execute(fstmt->getBody());
+      this->Visit(fstmt->getInc());
+      scope.step();
+    } while (true);
+  }
+
+  virtual void VisitCStyleCastExpr(CStyleCastExpr *ccastexpr) {
+    ccastexpr->dump();
+    VisitChildren(ccastexpr);
+    stealBindingFromChild(ccastexpr);
+  }
+
+  virtual void VisitImplicitCastExpr(ImplicitCastExpr *icastexpr) {
+    icastexpr->dump();
+    VisitChildren(icastexpr);
+    stealBindingFromChild(icastexpr);
+  }
+
+  virtual void VisitParenExpr(ParenExpr *parenexpr) {
+    parenexpr->dump();
+    VisitChildren(parenexpr);
+    stealBindingFromChild(parenexpr);
+  }
+
+  /// for some AST(e.g., ImplicitCastExpr, CStyleCastExpr), we need to have their "value" binding
+  /// so we steal the value binding from their children. usually, they have only one child
+  void stealBindingFromChild(Stmt *parent) {
+    parent->dump();
+    Stmt *stmt = nullptr;
+    for (auto *c : parent->children()) {
+      stmt = c;
+      break;
+    }
+
+    if (stmt) {
+      if (mEnv_->stackTop().hasStmt(stmt)) {
+        mEnv_->bindStmt(parent, mEnv_->stackTop().getStmtVal(stmt));
+        // llvm::outs() << "succ\n";
+        // stmt->dump();
+        return;
+      }
+    }
+  }
+
+  virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *uexpr) {
+    uexpr->dump();
+    VisitChildren(uexpr);
+    /// we assume the op must be `sizeof`
+    // uexpr->getExprStmt()->dump();
+    auto arg_type = uexpr->getArgumentTypeInfo()->getType();
+    int sz = 0;
+    if (arg_type->isPointerType()) {
+      sz = sizeof(Heap::HeapAddr);
+    } else if (arg_type->isIntegerType()) {
+      sz = sizeof(int);
+    } else {
+      llvm::outs() << "Unknown Type:\n";
+      arg_type.dump();
+      throw std::exception();
+    }
+    mEnv_->bindStmt(uexpr, sz);
+  }
+
+ private:
+  Environment *mEnv_;
+  Coverage *mCoverage_ = nullptr;
+  Profiler *mProfiler_ = nullptr;
+};
+
+/// knobs set from the command line of clang-interpreter, the defaults run the program as is
+struct InterpreterOptions {
+  std::string mSnapshotOut_;  /// where `CHECKPOINT()` writes its snapshot
+  std::string mSnapshotIn_;   /// snapshot to resume from instead of starting main from scratch
+  bool mStats_ = false;       /// print execution counters once the program is done
+  std::string mHeapReport_;   /// JSON heap usage report, "-" for stdout
+  std::string mCoverage_;     /// lcov tracefile of line, function and branch counts
+  std::string mBranchBias_;   /// JSON taken/not-taken counts of every condition
+  std::string mRecord_;       /// trace of the builtin calls to write
+  std::string mReplay_;       /// trace of the builtin calls to feed back instead of doing I/O
+  std::string mProfile_;      /// sampled stacks in the folded format of flamegraph.pl
+  int mProfileHz_ = 1000;     /// samples per second of CPU time
+  bool mRegIR_ = false;       /// run on register code, see RegMachine.h
+  RegCache *mRegCache_ = nullptr;  /// lowered functions kept across the runs of a session
+};
+
+class InterpreterConsumer : public ASTConsumer {
+ public:
+  InterpreterConsumer(const ASTContext &context, const InterpreterOptions &options)
+      : mVisitor_(context, &mEnv_), mOptions_(options) {
+    registerNativeBuiltins(mEnv_.getBuiltins());
+  }
+  ~InterpreterConsumer() override = default;
+
+  void HandleTranslationUnit(clang::ASTContext &Context) override {
+    TranslationUnitDecl *decl = Context.getTranslationUnitDecl();
+    /// snapshots and traces must match the program they came from
+    const SourceManager &sm = Context.getSourceManager();
+    uint64_t fingerprint = Snapshot::fingerprint(sm.getBufferData(sm.getMainFileID()));
+
+    /// set up before init, the initializers of globals may call builtins too
+    std::unique_ptr<Trace> trace;
+    if (!mOptions_.mRecord_.empty()) {
+      trace = Trace::record(mOptions_.mRecord_, fingerprint);
+    } else if (!mOptions_.mReplay_.empty()) {
+      trace = Trace::replay(mOptions_.mReplay_, fingerprint);
+    }
+    if (!trace && (!mOptions_.mRecord_.empty() || !mOptions_.mReplay_.empty())) {
+      return;
+    }
+    mEnv_.setTrace(trace.get());
+
+    mEnv_.init(decl);
+    FunctionDecl *entry = mEnv_.getEntry();
+
+    /// snapshots need stable names for the AST nodes
+    std::unique_ptr<AstIndex> index;
+    if (!mOptions_.mSnapshotIn_.empty() || !mOptions_.mSnapshotOut_.empty()) {
+      index = std::make_unique<AstIndex>(decl);
+    }
+
+    unsigned resume = 0;
+    if (!mOptions_.mSnapshotIn_.empty() && !Snapshot::load(mOptions_.mSnapshotIn_, mEnv_, *index, fingerprint, resume)) {
+      return;
+    }
+
+    std::unique_ptr<Coverage> coverage;
+    if (!mOptions_.mCoverage_.empty() || !mOptions_.mBranchBias_.empty()) {
+      coverage = std::make_unique<Coverage>(decl, sm);
+      coverage->hit(entry->getBody());
+      mVisitor_.setCoverage(coverage.get());
+    }
+
+    std::unique_ptr<Profiler> profiler;
+    if (!mOptions_.mProfile_.empty()) {
+      profiler = std::make_unique<Profiler>(sm);
+      if (profiler->start(mOptions_.mProfileHz_)) {
+        mVisitor_.setProfiler(profiler.get());
+      }
+    }
+
+    /// the register engine has no statement boundaries to snapshot, count or sample at
+    std::unique_ptr<RegEngine> regir;
+    if (mOptions_.mRegIR_) {
+      if (index || coverage || profiler) {
+        llvm::outs() << "regir: snapshots, coverage and profiles need the AST interpreter\n";
+      } else {
+        regir = std::make_unique<RegEngine>(mEnv_, decl, mOptions_.mRegCache_ ? *mOptions_.mRegCache_ : mRegCache_);
+        if (!regir->prepare(entry)) {
+          regir.reset();
+        }
+      }
+    }
+
+    try {
+      if (regir) {
+        if (regir->run() != 0) {
+          llvm::outs() << "main exit with a non-zero code!\n";
+        }
+      } else {
+        runMain(entry, resume, index.get(), fingerprint);
+      }
+    } catch (HeapError &) {
+      llvm::outs() << "run stopped by a bad heap access\n";
+    }
+
+    if (profiler) {
+      profiler->stop();
+      mVisitor_.setProfiler(nullptr);
+    }
+    if (trace && !trace->finish() && !mOptions_.mRecord_.empty()) {
+      llvm::errs() << "trace: cannot write " << mOptions_.mRecord_ << "\n";
+    }
+
+    HeapReport heap_report(mEnv_.getHeap(), sm);
+    if (mOptions_.mStats_) {
+      mEnv_.getSuperInstructions().printStats(llvm::outs());
+      mEnv_.getLoopOptimizer().printStats(llvm::outs());
+      if (regir) {
+        regir->printStats(llvm::outs());
+      }
+      heap_report.print(llvm::outs());
+      if (profiler) {
+        llvm::outs() << "profile: " << profiler->getNumSamples() << " samples\n";
+      }
+    }
+    if (!mOptions_.mHeapReport_.empty()) {
+      writeReport(mOptions_.mHeapReport_, [&](llvm::raw_ostream &os) { heap_report.writeJSON(os); });
+    }
+    if (!mOptions_.mCoverage_.empty()) {
+      writeReport(mOptions_.mCoverage_, [&](llvm::raw_ostream &os) { coverage->writeLcov(os); });
+    }
+    if (!mOptions_.mBranchBias_.empty()) {
+      writeReport(mOptions_.mBranchBias_, [&](llvm::raw_ostream &os) { coverage->writeBranchBias(os); });
+    }
+    if (profiler) {
+      writeReport(mOptions_.mProfile_, [&](llvm::raw_ostream &os) { profiler->writeFolded(os); });
+    }
+  }
+
+ private:
+  /// main is run one top-level statement at a time, its statement boundaries are the points a
+  /// snapshot can be taken at and resumed from
+  void runMain(FunctionDecl *entry, unsigned resume, AstIndex *index, uint64_t fingerprint) {
+    try {
+      unsigned i = 0;
+      for (Stmt *stmt : entry->getBody()->children()) {
+        if (i++ < resume) {
+          continue;
+        }
+        mVisitor_.execute(stmt);
+        if (mEnv_.takeCheckpointRequest() && !mOptions_.mSnapshotOut_.empty()) {
+          Snapshot::save(mOptions_.mSnapshotOut_, mEnv_, *index, fingerprint, i);
+        }
+      }
+    } catch (ReturnException &e) {
+      if (e.getRetVal() != 0) {
+        llvm::outs() << "main exit with a non-zero code!\n";
+      }
+    }
+  }
+
+  template <typename Fn>
+  static void writeReport(const std::string &path, Fn writer) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec);
+    if (ec) {
+      llvm::errs() << "cannot write " << path << ": " << ec.message() << "\n";
+      return;
+    }
+    writer(out);
+  }
+
+  Environment mEnv_;
+  InterpreterVisitor mVisitor_;
+  InterpreterOptions mOptions_;
+  RegCache mRegCache_;  /// used outside of sessions
+};
+
+class InterpreterFrontendAction : public ASTFrontendAction {
+ public:
+  InterpreterFrontendAction() = default;
+  explicit InterpreterFrontendAction(const InterpreterOptions &options) : mOptions_(options) {}
+
+  std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &ci,
+                                                        llvm::StringRef /*InFile*/) override {
+    return std::unique_ptr<clang::ASTConsumer>(new InterpreterConsumer(ci.getASTContext(), mOptions_));
+  }
+
+ private:
+  InterpreterOptions mOptions_;
+};
+
+/// Interprets the program in `source`. The buffer is handed to clang through an in-memory file
+/// system layered over the real one, so it is parsed in place and includes still resolve; `name`
+/// is the file name diagnostics, coverage and profiles refer to.
+inline bool interpretBuffer(std::unique_ptr<llvm::MemoryBuffer> source, llvm::StringRef name,
+                            const InterpreterOptions &options) {
+  llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlay(
+      new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
+  llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> memory(new llvm::vfs::InMemoryFileSystem);
+  overlay->pushOverlay(memory);
+  memory->addFile(name, 0, std::move(source));
+
+  llvm::IntrusiveRefCntPtr<FileManager> files(new FileManager(FileSystemOptions(), overlay));
+  std::vector<std::string> args = {"clang-interpreter", "-fsyntax-only", "-x", "c++", name.str()};
+  tooling::ToolInvocation invocation(args, std::make_unique<InterpreterFrontendAction>(options), files.get());
+  return invocation.run();
+}
+
+/// Interprets the program in the file at `path`, "-" for stdin. Files are memory-mapped when
+/// they are large enough for that to pay off.
+inline bool interpretFile(const std::string &path, const InterpreterOptions &options) {
+  auto source = llvm::MemoryBuffer::getFileOrSTDIN(path);
+  if (!source) {
+    llvm::errs() << path << ": " << source.getError().message() << "\n";
+    return false;
+  }
+  return interpretBuffer(std::move(*source), path == "-" ? "<stdin>" : path, options);
+}
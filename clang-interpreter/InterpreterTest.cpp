@@ -0,0 +1,304 @@
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Interpreter.h"
+
+/// Differential test runner: every test program is run through the interpreter and through a
+/// reference build of the same program (plus buildin.cpp) that is JIT-compiled, then
+/// the interpreter's PRINT output (stderr) is compared with the reference's stdout.
+/// Both sides of a test run concurrently in forked children, so a crash on either side only
+/// fails that test, and the CPU time of each child is taken from its rusage. The reference is
+/// JIT-compiled in its own child too, so the compiles of parallel tests run in parallel; the
+/// child reports the CPU time of the compile, which is not counted as reference time.
+
+static llvm::cl::OptionCategory TestCategory("clang-interpreter-test options");
+static llvm::cl::list<std::string> TestFiles(llvm::cl::Positional, llvm::cl::desc("<test files>"), llvm::cl::OneOrMore,
+                                             llvm::cl::cat(TestCategory));
+static llvm::cl::opt<std::string> LibFile("lib", llvm::cl::desc("Reference implementation of the builtins"),
+                                          llvm::cl::init("buildin.cpp"), llvm::cl::cat(TestCategory));
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of tests to run in parallel (0 = all cores)"),
+                                    llvm::cl::init(0), llvm::cl::cat(TestCategory));
+static llvm::cl::opt<bool> RegIR("regir", llvm::cl::desc("Run the interpreter side on register code"),
+                                 llvm::cl::cat(TestCategory));
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/// Runs EmitLLVMOnlyAction on one TU and keeps the module, which a FrontendAction handed to
+/// ToolInvocation directly would destroy before we could take it.
+class EmitModuleAction : public clang::tooling::ToolAction {
+ public:
+  explicit EmitModuleAction(llvm::LLVMContext *ctx) : mCtx_(ctx) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> invocation, FileManager *files,
+                     std::shared_ptr<PCHContainerOperations> pchOps, DiagnosticConsumer *diagConsumer) override {
+    CompilerInstance ci(std::move(pchOps));
+    ci.setInvocation(std::move(invocation));
+    ci.setFileManager(files);
+    ci.createDiagnostics(diagConsumer, false);
+    ci.createSourceManager(*files);
+    EmitLLVMOnlyAction action(mCtx_);
+    if (!ci.ExecuteAction(action)) {
+      return false;
+    }
+    mModule_ = action.takeModule();
+    return mModule_ != nullptr;
+  }
+
+  std::unique_ptr<llvm::Module> takeModule() { return std::move(mModule_); }
+
+ private:
+  llvm::LLVMContext *mCtx_;
+  std::unique_ptr<llvm::Module> mModule_;
+};
+
+llvm::Expected<llvm::orc::ThreadSafeModule> compileToModule(const std::string &path) {
+  auto ctx = std::make_unique<llvm::LLVMContext>();
+  EmitModuleAction action(ctx.get());
+  llvm::IntrusiveRefCntPtr<FileManager> files(new FileManager(FileSystemOptions()));
+  std::vector<std::string> args = {"clang-interpreter-test", "-fsyntax-only", "-O2", "-x", "c++",
+                                   "-resource-dir", CLANG_RESOURCE_DIR, path};
+  clang::tooling::ToolInvocation invocation(args, &action, files.get());
+  if (!invocation.run()) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "cannot compile " + path);
+  }
+  return llvm::orc::ThreadSafeModule(action.takeModule(), std::move(ctx));
+}
+
+/// JIT-compiles `test` together with the builtin library and returns its `main`.
+llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> buildReference(const std::string &test, const std::string &lib) {
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) {
+    return jit.takeError();
+  }
+  auto &jd = (*jit)->getMainJITDylib();
+  auto generator =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*jit)->getDataLayout().getGlobalPrefix());
+  if (!generator) {
+    return generator.takeError();
+  }
+  jd.addGenerator(std::move(*generator));
+  for (const std::string &path : {test, lib}) {
+    auto module = compileToModule(path);
+    if (!module) {
+      return module.takeError();
+    }
+    if (auto err = (*jit)->addIRModule(std::move(*module))) {
+      return std::move(err);
+    }
+  }
+  return jit;
+}
+
+/// Redirects stdin/stdout/stderr of a freshly forked child. `-1` leaves the stream untouched.
+void redirect(int in, int out, int err) {
+  if (in >= 0) dup2(in, STDIN_FILENO);
+  if (out >= 0) dup2(out, STDOUT_FILENO);
+  if (err >= 0) dup2(err, STDERR_FILENO);
+}
+
+int openTemp(const char *prefix, std::string &path) {
+  int fd = -1;
+  llvm::SmallString<128> tmp;
+  if (llvm::sys::fs::createTemporaryFile(prefix, "txt", fd, tmp)) {
+    return -1;
+  }
+  path = std::string(tmp);
+  return fd;
+}
+
+std::string slurp(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  return buffer ? (*buffer)->getBuffer().str() : std::string();
+}
+
+struct TestCase {
+  std::string mPath_;
+  std::string mInputPath_, mInterpOutPath_, mRefOutPath_, mJitPath_;
+  double mJitMs_ = 0;
+  double mInterpMs_ = 0;
+  double mRefMs_ = 0;
+  int mPending_ = 0;
+  bool mSetupFailed_ = false;
+  bool mCrashed_ = false;
+};
+
+double cpuMs(const struct rusage &usage) {
+  auto ms = [](const struct timeval &tv) { return tv.tv_sec * 1e3 + tv.tv_usec / 1e3; };
+  return ms(usage.ru_utime) + ms(usage.ru_stime);
+}
+
+/// Forks the interpreter and the reference for `test`.
+void launch(TestCase &test, int input, std::map<pid_t, std::pair<TestCase *, bool>> &running) {
+  int in = openTemp("interp-in", test.mInputPath_);
+  int interp_out = openTemp("interp-out", test.mInterpOutPath_);
+  int ref_out = openTemp("interp-ref", test.mRefOutPath_);
+  int jit_out = openTemp("interp-jit", test.mJitPath_);
+  int null_fd = open("/dev/null", O_WRONLY);
+  {
+    llvm::raw_fd_ostream in_stream(in, /*shouldClose=*/false);
+    in_stream << input << "\n";
+  }
+
+  llvm::outs().flush();
+  fflush(stdout);
+
+  pid_t interp_pid = fork();
+  if (interp_pid == 0) {
+    // the interpreter logs to stdout and PRINTs to stderr
+    redirect(open(test.mInputPath_.c_str(), O_RDONLY), null_fd, interp_out);
+    InterpreterOptions options;
+    options.mRegIR_ = RegIR;
+    interpretFile(test.mPath_, options);
+    llvm::outs().flush();
+    _exit(0);
+  }
+
+  pid_t ref_pid = fork();
+  if (ref_pid == 0) {
+    // compile errors still go to the runner's stderr; an empty jit file marks a failed setup
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    auto jit = buildReference(test.mPath_, LibFile);
+    if (!jit) {
+      llvm::errs() << test.mPath_ << ": " << llvm::toString(jit.takeError()) << "\n";
+      _exit(1);
+    }
+    auto entry = (*jit)->lookup("main");
+    if (!entry) {
+      llvm::errs() << test.mPath_ << ": " << llvm::toString(entry.takeError()) << "\n";
+      _exit(1);
+    }
+    getrusage(RUSAGE_SELF, &after);
+    {
+      llvm::raw_fd_ostream jit_stream(jit_out, /*shouldClose=*/false);
+      jit_stream << llvm::format("%.3f\n", cpuMs(after) - cpuMs(before));
+    }
+    redirect(open(test.mInputPath_.c_str(), O_RDONLY), ref_out, null_fd);
+    auto *ref_main = entry->toPtr<int (*)()>();
+    int ret = ref_main();
+    fflush(stdout);
+    _exit(ret);
+  }
+
+  close(in);
+  close(interp_out);
+  close(ref_out);
+  close(jit_out);
+  close(null_fd);
+  running[interp_pid] = {&test, true};
+  running[ref_pid] = {&test, false};
+  test.mPending_ = 2;
+}
+
+void report(TestCase &test, bool passed) {
+  double ratio = test.mRefMs_ > 0 ? test.mInterpMs_ / test.mRefMs_ : 0;
+  llvm::outs() << llvm::format("%-16s %-7s interp %9.2f ms  ref %7.2f ms  jit %7.2f ms  ratio %8.1fx\n",
+                               llvm::sys::path::filename(test.mPath_).str().c_str(), passed ? "passed" : "FAILED",
+                               test.mInterpMs_, test.mRefMs_, test.mJitMs_, ratio);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  llvm::cl::HideUnrelatedOptions(TestCategory);
+  llvm::cl::ParseCommandLineOptions(argc, argv, "differential tester for clang-interpreter\n");
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  std::vector<TestCase> tests(TestFiles.size());
+  for (size_t i = 0; i < TestFiles.size(); i++) {
+    tests[i].mPath_ = TestFiles[i];
+  }
+
+  unsigned jobs = Jobs ? Jobs : std::max(1u, std::thread::hardware_concurrency());
+  std::map<pid_t, std::pair<TestCase *, bool>> running;
+  size_t next = 0;
+  unsigned passed = 0;
+  unsigned setup_failed = 0;
+  double interp_total = 0;
+  double ref_total = 0;
+
+  llvm::outs() << "total test cases: " << tests.size() << "\n";
+  auto start = Clock::now();
+  while (next < tests.size() || !running.empty()) {
+    // each running test holds two children
+    while (next < tests.size() && running.size() < 2 * jobs) {
+      TestCase &test = tests[next];
+      // the test's ordinal is its user input, so parallel runs stay reproducible
+      launch(test, next, running);
+      next++;
+    }
+    if (running.empty()) {
+      continue;
+    }
+
+    int status = 0;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) {
+      break;
+    }
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    TestCase &test = *it->second.first;
+    bool is_interp = it->second.second;
+    running.erase(it);
+    (is_interp ? test.mInterpMs_ : test.mRefMs_) = cpuMs(usage);
+    // a reference that crashes or fails is as wrong as an interpreter that does
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      test.mCrashed_ = true;
+    }
+    if (--test.mPending_ > 0) {
+      continue;
+    }
+
+    std::string jit_ms = slurp(test.mJitPath_);
+    if (llvm::StringRef(jit_ms).trim().getAsDouble(test.mJitMs_)) {
+      test.mSetupFailed_ = true;
+    }
+    test.mRefMs_ = std::max(0.0, test.mRefMs_ - test.mJitMs_);
+
+    bool ok = !test.mSetupFailed_ && !test.mCrashed_ && slurp(test.mInterpOutPath_) == slurp(test.mRefOutPath_);
+    passed += ok;
+    setup_failed += test.mSetupFailed_;
+    interp_total += test.mInterpMs_;
+    ref_total += test.mRefMs_;
+    report(test, ok);
+    for (const std::string &path : {test.mInputPath_, test.mInterpOutPath_, test.mRefOutPath_, test.mJitPath_}) {
+      llvm::sys::fs::remove(path);
+    }
+  }
+
+  double wall = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  llvm::outs() << llvm::format("%u/%zu passed (%u without a reference build), interp %.2f ms, ref %.2f ms, "
+                               "ratio %.1fx, wall %.2f ms\n",
+                               passed, tests.size(), setup_failed, interp_total, ref_total,
+                               ref_total > 0 ? interp_total / ref_total : 0.0, wall);
+  return passed == tests.size() ? 0 : 1;
+}
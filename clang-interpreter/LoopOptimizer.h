@@ -0,0 +1,289 @@
+#pragma once
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace clang;
+
+/// What the interpreter can skip re-evaluating in one `for` loop
+struct LoopPlan {
+  /// an expression that moves by a fixed delta each time the induction variable is stepped
+  struct Stride {
+    Expr *mExpr_;
+    int mDelta_;
+    bool mScaled_;  /// pointer arithmetic, the delta is in elements and scaled by Heap::step2Size
+  };
+
+  llvm::SmallVector<Expr *, 4> mInvariants_;  /// evaluated once when the loop is entered
+  llvm::SmallVector<Stride, 2> mStrides_;     /// evaluated once, then advanced after each increment
+};
+
+/// Finds, for every `for` loop, the maximal pure expressions whose operands are not modified in
+/// the loop, and the expressions `p +/- i` and `i * C` over an induction variable `i` that only
+/// the loop's increment steps by a constant. A loop is analyzed over its condition, increment and
+/// body, the init statement runs before the plan is applied.
+class LoopOptimizer : public RecursiveASTVisitor<LoopOptimizer> {
+ public:
+  void build(TranslationUnitDecl *unit) { TraverseDecl(unit); }
+
+  const LoopPlan *lookup(ForStmt *fstmt) const {
+    auto it = mPlans_.find(fstmt);
+    return it == mPlans_.end() ? nullptr : &it->second;
+  }
+
+  void countReuse() { mReused_++; }
+
+  void printStats(llvm::raw_ostream &os) const {
+    os << "loops: " << mPlans_.size() << " optimized, " << mReused_ << " evaluations reused\n";
+  }
+
+  bool VisitForStmt(ForStmt *fstmt) {
+    LoopAnalysis analysis(fstmt);
+    LoopPlan plan;
+    Stmt *parts[] = {fstmt->getCond(), fstmt->getInc(), fstmt->getBody()};
+    for (Stmt *part : parts) {
+      analysis.collect(part, plan);
+    }
+    if (!plan.mInvariants_.empty() || !plan.mStrides_.empty()) {
+      mPlans_[fstmt] = std::move(plan);
+    }
+    return true;
+  }
+
+ private:
+  class LoopAnalysis : public RecursiveASTVisitor<LoopAnalysis> {
+   public:
+    explicit LoopAnalysis(ForStmt *fstmt) : mHasCall_(false), mIV_(nullptr), mStep_(0) {
+      Stmt *parts[] = {fstmt->getCond(), fstmt->getInc(), fstmt->getBody()};
+      for (Stmt *part : parts) {
+        TraverseStmt(part);
+      }
+      findInductionVariable(fstmt->getInc());
+    }
+
+    bool VisitBinaryOperator(BinaryOperator *bop) {
+      if (bop->isAssignmentOp()) {
+        modify(bop->getLHS());
+      }
+      return true;
+    }
+
+    bool VisitUnaryOperator(UnaryOperator *uop) {
+      if (uop->isIncrementDecrementOp() || uop->getOpcode() == UO_AddrOf) {
+        modify(uop->getSubExpr());
+      }
+      return true;
+    }
+
+    bool VisitVarDecl(VarDecl *vdecl) {
+      mModified_[vdecl] += 2;  // re-initialized on every iteration
+      return true;
+    }
+
+    bool VisitCallExpr(CallExpr *call) {
+      FunctionDecl *callee = call->getDirectCallee();
+      if (!callee || callee->hasBody()) {
+        mHasCall_ = true;  // may write any global
+      }
+      return true;
+    }
+
+    /// adds the maximal invariant subexpressions and the strided expressions of `stmt` to `plan`
+    void collect(Stmt *stmt, LoopPlan &plan) {
+      if (!stmt) {
+        return;
+      }
+      if (auto *expr = dyn_cast<Expr>(stmt)) {
+        LoopPlan::Stride stride = {expr, 0, false};
+        if (isStrided(expr, stride)) {
+          plan.mStrides_.push_back(stride);
+          return;
+        }
+        if (isInvariant(expr)) {
+          if (isWorthHoisting(expr)) {
+            plan.mInvariants_.push_back(expr);
+          }
+          return;
+        }
+      }
+      for (Stmt *child : stmt->children()) {
+        collect(child, plan);
+      }
+    }
+
+   private:
+    void modify(Expr *lhs) {
+      if (auto *ref = dyn_cast<DeclRefExpr>(lhs->IgnoreParenImpCasts())) {
+        mModified_[ref->getFoundDecl()]++;
+      }
+    }
+
+    bool isUnmodified(VarDecl *var) const {
+      if (mModified_.count(var)) {
+        return false;
+      }
+      return var->hasLocalStorage() || !mHasCall_;
+    }
+
+    /// `i = i +/- C`, `i += C`, `i -= C`, `++i`, `i++`, `--i` or `i--` as the loop increment, with
+    /// `i` not written anywhere else in the loop
+    void findInductionVariable(Expr *inc) {
+      VarDecl *var = nullptr;
+      int step = 0;
+      if (!inc || !matchStep(inc->IgnoreParens(), var, step)) {
+        return;
+      }
+      if (!var->getType()->isIntegerType() || mModified_.lookup(var) != 1 || (!var->hasLocalStorage() && mHasCall_)) {
+        return;
+      }
+      mIV_ = var;
+      mStep_ = step;
+    }
+
+    static bool matchStep(Expr *inc, VarDecl *&var, int &step) {
+      if (auto *uop = dyn_cast<UnaryOperator>(inc)) {
+        var = uop->isIncrementDecrementOp() ? asVar(uop->getSubExpr()) : nullptr;
+        step = uop->isIncrementOp() ? 1 : -1;
+        return var != nullptr;
+      }
+      auto *bop = dyn_cast<BinaryOperator>(inc);
+      if (!bop) {
+        return false;
+      }
+      var = asVar(bop->getLHS());
+      Expr *delta = nullptr;
+      BinaryOperatorKind op_code = BO_Add;
+      if (bop->getOpcode() == BO_AddAssign || bop->getOpcode() == BO_SubAssign) {
+        op_code = BinaryOperator::getOpForCompoundAssignment(bop->getOpcode());
+        delta = bop->getRHS();
+      } else if (bop->getOpcode() == BO_Assign) {
+        auto *rhs = dyn_cast<BinaryOperator>(bop->getRHS()->IgnoreParenImpCasts());
+        if (!rhs || !rhs->isAdditiveOp() || asVar(rhs->getLHS()) != var) {
+          return false;
+        }
+        op_code = rhs->getOpcode();
+        delta = rhs->getRHS();
+      }
+      auto *lit = delta ? dyn_cast<IntegerLiteral>(delta->IgnoreParenImpCasts()) : nullptr;
+      if (!var || !lit) {
+        return false;
+      }
+      step = lit->getValue().getSExtValue();
+      if (op_code == BO_Sub) {
+        step = -step;
+      }
+      return true;
+    }
+
+    static VarDecl *asVar(Expr *expr) {
+      auto *ref = dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts());
+      return ref ? dyn_cast<VarDecl>(ref->getFoundDecl()) : nullptr;
+    }
+
+    bool isIV(Expr *expr) const { return mIV_ && asVar(expr) == mIV_; }
+
+    /// `p + i`, `i + p`, `p - i` with `p` an invariant pointer, or `i * C`
+    bool isStrided(Expr *expr, LoopPlan::Stride &stride) {
+      auto *bop = dyn_cast<BinaryOperator>(expr);
+      if (!mIV_ || !bop) {
+        return false;
+      }
+      Expr *lhs = bop->getLHS();
+      Expr *rhs = bop->getRHS();
+      if (bop->getOpcode() == BO_Mul) {
+        auto *lit = dyn_cast<IntegerLiteral>(rhs->IgnoreParenImpCasts());
+        if (isIV(lhs) && lit) {
+          stride.mDelta_ = mStep_ * lit->getValue().getSExtValue();
+          return true;
+        }
+        return false;
+      }
+      if (!bop->isAdditiveOp()) {
+        return false;
+      }
+      stride.mScaled_ = true;
+      if (lhs->getType()->isPointerType() && isInvariant(lhs) && isIV(rhs)) {
+        stride.mDelta_ = bop->getOpcode() == BO_Add ? mStep_ : -mStep_;
+        return true;
+      }
+      if (bop->getOpcode() == BO_Add && rhs->getType()->isPointerType() && isInvariant(rhs) && isIV(lhs)) {
+        stride.mDelta_ = mStep_;
+        return true;
+      }
+      return false;
+    }
+
+    /// pure and cannot trap, and every variable it reads keeps its value during the loop
+    bool isInvariant(Expr *expr) {
+      auto it = mInvariant_.find(expr);
+      if (it != mInvariant_.end()) {
+        return it->second;
+      }
+      bool res = computeInvariant(expr);
+      mInvariant_[expr] = res;
+      return res;
+    }
+
+    bool computeInvariant(Expr *expr) {
+      if (isa<IntegerLiteral>(expr) || isa<UnaryExprOrTypeTraitExpr>(expr)) {
+        return true;
+      }
+      if (auto *ref = dyn_cast<DeclRefExpr>(expr)) {
+        auto *var = dyn_cast<VarDecl>(ref->getFoundDecl());
+        if (!var) {
+          return false;
+        }
+        auto type = var->getType();
+        return (type->isIntegerType() || type->isPointerType() || type->isArrayType()) && isUnmodified(var);
+      }
+      if (auto *paren = dyn_cast<ParenExpr>(expr)) {
+        return isInvariant(paren->getSubExpr());
+      }
+      if (auto *cast = dyn_cast<CastExpr>(expr)) {
+        return (isa<ImplicitCastExpr>(cast) || isa<CStyleCastExpr>(cast)) && isInvariant(cast->getSubExpr());
+      }
+      if (auto *uop = dyn_cast<UnaryOperator>(expr)) {
+        switch (uop->getOpcode()) {
+          case UO_Minus:
+          case UO_Plus:
+          case UO_Not:
+          case UO_LNot:
+            return isInvariant(uop->getSubExpr());
+          default:
+            return false;
+        }
+      }
+      if (auto *bop = dyn_cast<BinaryOperator>(expr)) {
+        if (bop->isAssignmentOp() || bop->isLogicalOp() || bop->isCommaOp()) {
+          return false;
+        }
+        if (bop->isMultiplicativeOp() && bop->getOpcode() != BO_Mul) {
+          /// only a division by a non-zero constant is known not to trap
+          auto *lit = dyn_cast<IntegerLiteral>(bop->getRHS()->IgnoreParenImpCasts());
+          if (!lit || lit->getValue() == 0) {
+            return false;
+          }
+        }
+        return isInvariant(bop->getLHS()) && isInvariant(bop->getRHS());
+      }
+      return false;
+    }
+
+    /// a lone variable or constant costs as much to look up as to evaluate
+    static bool isWorthHoisting(Expr *expr) {
+      expr = expr->IgnoreParenImpCasts();
+      return isa<BinaryOperator>(expr) || isa<UnaryOperator>(expr) || isa<UnaryExprOrTypeTraitExpr>(expr);
+    }
+
+    llvm::DenseMap<Decl *, unsigned> mModified_;  /// number of writes in the loop
+    llvm::DenseMap<Expr *, bool> mInvariant_;
+    bool mHasCall_;
+    VarDecl *mIV_;
+    int mStep_;
+  };
+
+  llvm::DenseMap<ForStmt *, LoopPlan> mPlans_;
+  uint64_t mReused_ = 0;
+};
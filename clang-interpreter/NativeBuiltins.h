@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Environment.h"
+
+/// The builtins every interpreted program can declare, buildin.cpp has their reference versions.
+/// Pointers are heap addresses and sizes are in bytes, as in the interpreted program.
+namespace native {
+
+inline int get(Environment &, llvm::ArrayRef<int>) {
+  int val = 0;
+  llvm::outs() << "please input an integer value: ";
+  scanf("%d", &val);
+  return val;
+}
+
+inline int print(Environment &, llvm::ArrayRef<int> args) {
+  llvm::errs() << args[0];
+  return 0;
+}
+
+inline int malloc(Environment &env, llvm::ArrayRef<int> args) {
+  return env.getHeap().Malloc(args[0], env.stackTop().getPC());
+}
+
+inline int free(Environment &env, llvm::ArrayRef<int> args) {
+  env.getHeap().Free(args[0]);
+  return 0;
+}
+
+inline int checkpoint(Environment &env, llvm::ArrayRef<int>) {
+  env.requestCheckpoint();
+  return 0;
+}
+
+/// MEMCPY(dst, src, n), the ranges may overlap
+inline int memcpy(Environment &env, llvm::ArrayRef<int> args) {
+  env.getHeap().copy(args[0], args[1], args[2]);
+  return 0;
+}
+
+/// MEMSET(dst, byte, n)
+inline int memset(Environment &env, llvm::ArrayRef<int> args) {
+  env.getHeap().fill(args[0], args[1], args[2]);
+  return 0;
+}
+
+/// SORT(ints, count), ascending
+inline int sort(Environment &env, llvm::ArrayRef<int> args) {
+  llvm::MutableArrayRef<int> ints = env.getHeap().ints(args[0], args[1]);
+  std::sort(ints.begin(), ints.end());
+  return 0;
+}
+
+/// HASH(ints, count), 32-bit FNV-1a over the bytes of the ints
+inline int hash(Environment &env, llvm::ArrayRef<int> args) {
+  llvm::MutableArrayRef<int> ints = env.getHeap().ints(args[0], args[1]);
+  const unsigned char *bytes = (const unsigned char *)ints.data();
+  unsigned h = 2166136261u;
+  for (size_t i = 0; i < ints.size() * sizeof(int); i++) {
+    h = (h ^ bytes[i]) * 16777619u;
+  }
+  return (int)h;
+}
+
+}  // namespace native
+
+inline void registerNativeBuiltins(BuiltinRegistry &registry) {
+  registry.add("GET", 0, true, native::get, true);
+  registry.add("PRINT", 1, false, native::print, true);
+  registry.add("MALLOC", 1, true, native::malloc);
+  registry.add("FREE", 1, false, native::free);
+  registry.add("CHECKPOINT", 0, false, native::checkpoint);
+  registry.add("MEMCPY", 3, false, native::memcpy);
+  registry.add("MEMSET", 3, false, native::memset);
+  registry.add("SORT", 2, false, native::sort);
+  registry.add("HASH", 2, true, native::hash);
+}
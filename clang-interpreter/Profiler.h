@@ -0,0 +1,116 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "clang/AST/Expr.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Environment.h"
+
+using namespace clang;
+
+/// Sampling profiler of the interpreted program. A SIGPROF timer only raises a flag, the stack is
+/// captured at the next statement the interpreter runs, so the handler never touches interpreter
+/// state. A sample is the chain of the frames' PCs, the innermost one being the statement that
+/// is about to run, and identical chains are aggregated.
+///
+/// The output is in the folded format of flamegraph.pl, one line per distinct stack:
+///
+///   main:12;fib:5;fib:7 42
+class Profiler {
+ public:
+  explicit Profiler(const SourceManager &sm) : mSM_(sm) {}
+  ~Profiler() { stop(); }
+
+  /// starts the timer, `hz` samples per second of CPU time
+  bool start(int hz) {
+    struct sigaction action = {};
+    action.sa_handler = [](int) { sPending_ = 1; };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+      llvm::errs() << "profiler: cannot install the SIGPROF handler\n";
+      return false;
+    }
+    struct itimerval timer = {};
+    int period = 1000000 / std::max(hz, 1);  // in microseconds
+    timer.it_interval.tv_sec = period / 1000000;
+    timer.it_interval.tv_usec = period % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+      llvm::errs() << "profiler: cannot start the timer\n";
+      return false;
+    }
+    mRunning_ = true;
+    return true;
+  }
+
+  void stop() {
+    if (mRunning_) {
+      struct itimerval timer = {};
+      setitimer(ITIMER_PROF, &timer, nullptr);
+      mRunning_ = false;
+    }
+  }
+
+  /// called at every safepoint, cheap unless a sample is due
+  void poll(Environment &env, Stmt *next) {
+    if (sPending_) {
+      sPending_ = 0;
+      sample(env.getStack(), next);
+    }
+  }
+
+  void writeFolded(llvm::raw_ostream &os) const {
+    for (const auto &entry : mSamples_) {
+      const std::vector<Stmt *> &chain = entry.first;
+      for (size_t i = 0; i < chain.size(); i++) {
+        if (i) {
+          os << ";";
+        }
+        os << frameName(i ? chain[i - 1] : nullptr) << ":" << line(chain[i]);
+      }
+      os << " " << entry.second << "\n";
+    }
+  }
+
+  uint64_t getNumSamples() const { return mNumSamples_; }
+
+ private:
+  void sample(std::vector<StackFrame> &stack, Stmt *next) {
+    std::vector<Stmt *> chain;
+    chain.reserve(stack.size());
+    for (size_t i = 0; i + 1 < stack.size(); i++) {
+      chain.push_back(stack[i].getPC());
+    }
+    chain.push_back(next);
+    mSamples_[chain]++;
+    mNumSamples_++;
+  }
+
+  /// a frame is named after the callee of its caller's current call, frame 0 runs main
+  static std::string frameName(Stmt *callerPC) {
+    if (!callerPC) {
+      return "main";
+    }
+    auto *call = dyn_cast<CallExpr>(callerPC);
+    FunctionDecl *callee = call ? call->getDirectCallee() : nullptr;
+    return callee ? callee->getNameAsString() : "?";
+  }
+
+  unsigned line(Stmt *stmt) const { return stmt ? mSM_.getExpansionLineNumber(stmt->getBeginLoc()) : 0; }
+
+  static inline volatile sig_atomic_t sPending_ = 0;
+
+  const SourceManager &mSM_;
+  bool mRunning_ = false;
+  std::map<std::vector<Stmt *>, uint64_t> mSamples_;
+  uint64_t mNumSamples_ = 0;
+};
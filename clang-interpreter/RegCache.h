@@ -0,0 +1,85 @@
+#pragma once
+
+#include <memory>
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/ODRHash.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "RegIR.h"
+
+using namespace clang;
+
+/// Lowered functions kept across the runs of a session. A function is keyed by its name and by
+/// the ODR hash of its declaration and body, which covers names, types and literals but not
+/// source locations, so an edit elsewhere in the file does not invalidate it and only the
+/// functions that changed are lowered again. Lowered code refers to callees and globals by name,
+/// the engine links it against each run's program. The hash covers a referenced global by name
+/// only, so the engine also checks the callee arities and global types each lowering recorded.
+class RegCache {
+ public:
+  static unsigned key(FunctionDecl *fdecl) {
+    ODRHash hash;
+    hash.AddFunctionDecl(fdecl);
+    return hash.CalculateHash();
+  }
+
+  /// the cached lowering of `name`, null if there is none for this version of the function or
+  /// `valid` rejects it, e.g. because a callee it calls by name has become a builtin
+  template <typename Valid>
+  const RegFunction *lookup(llvm::StringRef name, unsigned key, Valid valid) {
+    auto it = mEntries_.find(name);
+    if (it == mEntries_.end()) {
+      return nullptr;
+    }
+    if (it->second.mKey_ != key || !valid(*it->second.mFn_)) {
+      mEntries_.erase(it);
+      return nullptr;
+    }
+    it->second.mLastRun_ = mRun_;
+    mNumReused_++;
+    return it->second.mFn_.get();
+  }
+
+  const RegFunction *insert(llvm::StringRef name, unsigned key, std::unique_ptr<RegFunction> fn) {
+    Entry &entry = mEntries_[name];
+    entry.mKey_ = key;
+    entry.mLastRun_ = mRun_;
+    entry.mFn_ = std::move(fn);
+    mNumLowered_++;
+    return entry.mFn_.get();
+  }
+
+  void beginRun() {
+    mRun_++;
+    mNumLowered_ = 0;
+    mNumReused_ = 0;
+  }
+
+  /// forgets the functions the last run did not use, they were deleted or renamed
+  void endRun() {
+    for (auto it = mEntries_.begin(); it != mEntries_.end();) {
+      auto cur = it++;
+      if (cur->second.mLastRun_ != mRun_) {
+        mEntries_.erase(cur);
+      }
+    }
+  }
+
+  void printStats(llvm::raw_ostream &os) const {
+    os << "session: run " << mRun_ << ", " << mNumLowered_ << " functions lowered, " << mNumReused_ << " reused\n";
+  }
+
+ private:
+  struct Entry {
+    unsigned mKey_ = 0;
+    unsigned mLastRun_ = 0;
+    std::unique_ptr<RegFunction> mFn_;
+  };
+
+  llvm::StringMap<Entry> mEntries_;
+  unsigned mRun_ = 0;
+  unsigned mNumLowered_ = 0;
+  unsigned mNumReused_ = 0;
+};
@@ -0,0 +1,787 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
+#include "Environment.h"
+
+using namespace clang;
+
+/// Three-address instructions over the registers of a frame. A, B and C are register numbers
+/// where the op has register operands, `imm` is a constant, a jump target, or an index into the
+/// function's symbols.
+enum class RegOp : uint8_t {
+  LoadImm,      /// A = imm
+  Move,         /// A = B
+  Add,          /// A = B op C, down to Ne
+  Sub,
+  Mul,
+  Div,
+  Rem,
+  Shl,
+  Shr,
+  And,
+  Or,
+  Xor,
+  Lt,
+  Gt,
+  Le,
+  Ge,
+  Eq,
+  Ne,
+  AddImm,       /// A = B + imm
+  MulImm,       /// A = B * imm
+  Neg,          /// A = -B
+  Not,          /// A = ~B
+  LNot,         /// A = !B
+  Bool,         /// A = B != 0
+  Load,         /// A = heap[B]
+  Store,        /// heap[A] = B
+  ArrayLoad,    /// A = array B [C]
+  ArrayStore,   /// array A [B] = C
+  NewArray,     /// A = id of a new array of imm elements
+  LoadGlobal,   /// A = global imm
+  StoreGlobal,  /// global imm = A
+  Jump,         /// goto imm
+  JumpIfZero,   /// if (!A) goto imm
+  JumpIfNonZero,
+  Call,         /// A = function imm (args), the args are registers mArgs_[B .. B + C)
+  CallBuiltin,  /// A = builtin imm (args)
+  Return,       /// return A
+  ReturnVoid,   /// return 0
+};
+
+struct RegInst {
+  RegOp mOp_;
+  uint32_t mA_;
+  uint32_t mB_;
+  uint32_t mC_;
+  int32_t mImm_;
+};
+
+/// What a function refers to by name, so that lowered code holds no AST pointers and can be
+/// linked against another parse of the same program
+struct RegSymbol {
+  enum Kind : uint8_t { Function, Builtin, Global };
+
+  Kind mKind_;
+  std::string mName_;
+  uint32_t mNumArgs_ = 0;  /// of a function, as called
+  std::string mType_;      /// canonical type of a global, the lowering depends on it (arrays, pointer steps)
+};
+
+/// spelling of the canonical type, the same across parses of the program
+inline std::string typeKey(QualType type) { return type.getCanonicalType().getAsString(); }
+
+/// One function lowered to register code. Registers are numbered per frame, mNumRegs_ of them
+/// after allocation; a call copies the arguments into the registers of the parameters.
+struct RegFunction {
+  std::string mName_;
+  std::vector<RegInst> mCode_;
+  std::vector<uint32_t> mArgs_;    /// argument registers of the calls
+  std::vector<uint32_t> mParams_;  /// register of each parameter
+  std::vector<RegSymbol> mSymbols_;
+  unsigned mNumValues_ = 0;        /// virtual registers before allocation
+  unsigned mNumRegs_ = 0;
+};
+
+/// Lowers the body of a function to a RegFunction and allocates its registers with a linear
+/// scan. Variables and temporaries start out in virtual registers of their own; the allocation
+/// then reuses a register once the live range of its value has ended.
+class RegLowering {
+ public:
+  /// returns false with a reason in `error` if the function uses something without a lowering
+  static bool lower(FunctionDecl *fdecl, Environment &env, RegFunction &fn, std::string &error) {
+    RegLowering lowering(env, fn);
+    lowering.lowerFunction(fdecl);
+    if (!lowering.mOk_) {
+      error = fdecl->getNameAsString() + ": " + lowering.mError_;
+      return false;
+    }
+    lowering.allocate();
+    return true;
+  }
+
+ private:
+  /// where an lvalue lives, its address registers are evaluated once
+  struct LValue {
+    enum Kind { Local, Global, Heap, Array };
+
+    Kind mKind_;
+    uint32_t mReg_;  /// the variable, the heap address or the array id
+    uint32_t mIdx_;  /// the element of an array
+    int32_t mSym_;   /// the global
+  };
+
+  struct LoopLabels {
+    std::vector<size_t> mBreaks_;
+    std::vector<size_t> mContinues_;
+  };
+
+  RegLowering(Environment &env, RegFunction &fn) : mEnv_(env), mFn_(fn) {}
+
+  void fail(Stmt *stmt, const char *what) {
+    if (mOk_) {
+      mOk_ = false;
+      mError_ = std::string(what) + " " + stmt->getStmtClassName();
+    }
+  }
+
+  /// a variable, or a temporary assigned on more than one path, lives across the whole of any
+  /// loop it appears in
+  uint32_t newVar() {
+    mIsVar_.push_back(true);
+    return mFn_.mNumValues_++;
+  }
+
+  uint32_t newTemp() {
+    mIsVar_.push_back(false);
+    return mFn_.mNumValues_++;
+  }
+
+  size_t emit(RegOp op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, int32_t imm = 0) {
+    mFn_.mCode_.push_back({op, a, b, c, imm});
+    return mFn_.mCode_.size() - 1;
+  }
+
+  uint32_t emitValue(RegOp op, uint32_t b = 0, uint32_t c = 0, int32_t imm = 0) {
+    uint32_t dst = newTemp();
+    emit(op, dst, b, c, imm);
+    return dst;
+  }
+
+  size_t here() const { return mFn_.mCode_.size(); }
+
+  void patch(size_t jump, size_t target) { mFn_.mCode_[jump].mImm_ = target; }
+
+  int32_t symbol(RegSymbol::Kind kind, llvm::StringRef name, uint32_t numArgs = 0, QualType type = QualType()) {
+    auto it = mSymbolIds_.try_emplace(name, mFn_.mSymbols_.size());
+    if (it.second) {
+      mFn_.mSymbols_.push_back({kind, name.str(), numArgs, type.isNull() ? "" : typeKey(type)});
+    }
+    return it.first->second;
+  }
+
+  void lowerFunction(FunctionDecl *fdecl) {
+    mFn_.mName_ = fdecl->getNameAsString();
+    for (ParmVarDecl *param : fdecl->parameters()) {
+      uint32_t reg = newVar();
+      mLocals_[param] = reg;
+      mFn_.mParams_.push_back(reg);
+    }
+    lowerStmt(fdecl->getBody());
+    emit(RegOp::ReturnVoid);
+  }
+
+  void lowerStmt(Stmt *stmt) {
+    if (!stmt || !mOk_) {
+      return;
+    }
+    if (auto *expr = dyn_cast<Expr>(stmt)) {
+      lowerExpr(expr);
+      return;
+    }
+    switch (stmt->getStmtClass()) {
+      case Stmt::CompoundStmtClass:
+        for (Stmt *child : cast<CompoundStmt>(stmt)->body()) {
+          lowerStmt(child);
+        }
+        break;
+      case Stmt::DeclStmtClass:
+        for (Decl *decl : cast<DeclStmt>(stmt)->decls()) {
+          lowerVarDecl(stmt, decl);
+        }
+        break;
+      case Stmt::IfStmtClass: {
+        auto *ifstmt = cast<IfStmt>(stmt);
+        size_t to_else = emit(RegOp::JumpIfZero, lowerExpr(ifstmt->getCond()));
+        lowerStmt(ifstmt->getThen());
+        if (ifstmt->getElse()) {
+          size_t to_end = emit(RegOp::Jump);
+          patch(to_else, here());
+          lowerStmt(ifstmt->getElse());
+          patch(to_end, here());
+        } else {
+          patch(to_else, here());
+        }
+        break;
+      }
+      case Stmt::WhileStmtClass: {
+        auto *wstmt = cast<WhileStmt>(stmt);
+        size_t top = here();
+        size_t to_end = emit(RegOp::JumpIfZero, lowerExpr(wstmt->getCond()));
+        lowerLoopBody(wstmt->getBody(), top, [&] { emit(RegOp::Jump, 0, 0, 0, top); }, to_end);
+        break;
+      }
+      case Stmt::DoStmtClass: {
+        auto *dstmt = cast<DoStmt>(stmt);
+        size_t top = here();
+        mLoops_.emplace_back();
+        lowerStmt(dstmt->getBody());
+        size_t cont = here();
+        emit(RegOp::JumpIfNonZero, lowerExpr(dstmt->getCond()), 0, 0, top);
+        closeLoop(cont);
+        break;
+      }
+      case Stmt::ForStmtClass: {
+        auto *fstmt = cast<ForStmt>(stmt);
+        lowerStmt(fstmt->getInit());
+        size_t top = here();
+        size_t to_end = fstmt->getCond() ? emit(RegOp::JumpIfZero, lowerExpr(fstmt->getCond())) : SIZE_MAX;
+        lowerLoopBody(
+            fstmt->getBody(), SIZE_MAX,
+            [&] {
+              lowerStmt(fstmt->getInc());
+              emit(RegOp::Jump, 0, 0, 0, top);
+            },
+            to_end);
+        break;
+      }
+      case Stmt::BreakStmtClass:
+      case Stmt::ContinueStmtClass:
+        if (mLoops_.empty()) {
+          fail(stmt, "stray");
+          break;
+        }
+        (isa<BreakStmt>(stmt) ? mLoops_.back().mBreaks_ : mLoops_.back().mContinues_).push_back(emit(RegOp::Jump));
+        break;
+      case Stmt::ReturnStmtClass:
+        if (Expr *val = cast<ReturnStmt>(stmt)->getRetValue()) {
+          emit(RegOp::Return, lowerExpr(val));
+        } else {
+          emit(RegOp::ReturnVoid);
+        }
+        break;
+      case Stmt::NullStmtClass:
+        break;
+      default:
+        fail(stmt, "unsupported");
+        break;
+    }
+  }
+
+  /// the body of a while or for loop; `next` emits the increment, if any, and the back edge.
+  /// `cont` is where a continue goes, SIZE_MAX for the code `next` emits
+  template <typename Fn>
+  void lowerLoopBody(Stmt *body, size_t cont, Fn next, size_t to_end) {
+    mLoops_.emplace_back();
+    lowerStmt(body);
+    if (cont == SIZE_MAX) {
+      cont = here();
+    }
+    next();
+    if (to_end != SIZE_MAX) {
+      patch(to_end, here());
+    }
+    closeLoop(cont);
+  }
+
+  void closeLoop(size_t cont) {
+    for (size_t jump : mLoops_.back().mContinues_) {
+      patch(jump, cont);
+    }
+    for (size_t jump : mLoops_.back().mBreaks_) {
+      patch(jump, here());
+    }
+    mLoops_.pop_back();
+  }
+
+  void lowerVarDecl(Stmt *stmt, Decl *decl) {
+    auto *vdecl = dyn_cast<VarDecl>(decl);
+    if (!vdecl || !vdecl->hasLocalStorage()) {
+      fail(stmt, "static or non-variable declaration in");
+      return;
+    }
+    uint32_t reg = newVar();
+    mLocals_[vdecl] = reg;
+    auto type = vdecl->getType();
+    if (const auto *array_type = dyn_cast_or_null<ConstantArrayType>(type->getAsArrayTypeUnsafe())) {
+      emit(RegOp::NewArray, reg, 0, 0, array_type->getSize().getSExtValue());
+      if (vdecl->getInit()) {
+        fail(stmt, "array initializer in");
+      }
+      return;
+    }
+    if (!type->isIntegerType() && !type->isPointerType()) {
+      fail(stmt, "variable of unsupported type in");
+      return;
+    }
+    if (Expr *init = vdecl->getInit()) {
+      assign(reg, lowerExpr(init));
+    } else {
+      emit(RegOp::LoadImm, reg, 0, 0, 0);  // the AST interpreter zero-initializes as well
+    }
+  }
+
+  /// `dst = val` for a variable; the instruction that computed a fresh temporary is retargeted
+  /// to the variable instead of copying the temporary
+  void assign(uint32_t dst, uint32_t val) {
+    if (dst == val) {
+      return;
+    }
+    if (!mIsVar_[val] && !mFn_.mCode_.empty() && definesOnly(mFn_.mCode_.back(), val)) {
+      mFn_.mCode_.back().mA_ = dst;
+      return;
+    }
+    emit(RegOp::Move, dst, val);
+  }
+
+  static bool definesOnly(const RegInst &inst, uint32_t reg) {
+    switch (inst.mOp_) {
+      case RegOp::Store:
+      case RegOp::ArrayStore:
+      case RegOp::StoreGlobal:
+      case RegOp::Jump:
+      case RegOp::JumpIfZero:
+      case RegOp::JumpIfNonZero:
+      case RegOp::Return:
+      case RegOp::ReturnVoid:
+        return false;
+      default:
+        return inst.mA_ == reg;
+    }
+  }
+
+  LValue lowerLValue(Expr *expr) {
+    expr = expr->IgnoreParens();
+    if (auto *ref = dyn_cast<DeclRefExpr>(expr)) {
+      auto *var = dyn_cast<VarDecl>(ref->getDecl());
+      auto it = var ? mLocals_.find(var) : mLocals_.end();
+      if (it != mLocals_.end()) {
+        return {LValue::Local, it->second, 0, 0};
+      }
+      if (var && var->hasGlobalStorage() && !var->isStaticLocal()) {
+        return {LValue::Global, 0, 0, symbol(RegSymbol::Global, var->getName(), 0, var->getType())};
+      }
+      fail(expr, "unsupported reference in");
+      return {LValue::Local, newTemp(), 0, 0};
+    }
+    if (auto *uop = dyn_cast<UnaryOperator>(expr)) {
+      if (uop->getOpcode() == UO_Deref) {
+        return {LValue::Heap, lowerExpr(uop->getSubExpr()), 0, 0};
+      }
+    }
+    if (auto *arrsub = dyn_cast<ArraySubscriptExpr>(expr)) {
+      if (arrsub->getBase()->IgnoreParenImpCasts()->getType()->isArrayType()) {
+        uint32_t id = lowerExpr(arrsub->getBase());
+        return {LValue::Array, id, lowerExpr(arrsub->getIdx()), 0};
+      }
+      /// p[i] on a pointer is *(p + i)
+      uint32_t base = lowerExpr(arrsub->getBase());
+      uint32_t offset = emitValue(RegOp::MulImm, lowerExpr(arrsub->getIdx()), 0, Heap::getPtrSize());
+      return {LValue::Heap, emitValue(RegOp::Add, base, offset), 0, 0};
+    }
+    fail(expr, "unsupported lvalue");
+    return {LValue::Local, newTemp(), 0, 0};
+  }
+
+  /// a local is read in place, without a copy
+  uint32_t load(const LValue &lv) {
+    switch (lv.mKind_) {
+      case LValue::Local:
+        return lv.mReg_;
+      case LValue::Global:
+        return emitValue(RegOp::LoadGlobal, 0, 0, lv.mSym_);
+      case LValue::Heap:
+        return emitValue(RegOp::Load, lv.mReg_);
+      case LValue::Array:
+        return emitValue(RegOp::ArrayLoad, lv.mReg_, lv.mIdx_);
+    }
+    return 0;
+  }
+
+  /// returns the register holding the stored value
+  uint32_t store(const LValue &lv, uint32_t val) {
+    switch (lv.mKind_) {
+      case LValue::Local:
+        assign(lv.mReg_, val);
+        return lv.mReg_;
+      case LValue::Global:
+        emit(RegOp::StoreGlobal, val, 0, 0, lv.mSym_);
+        break;
+      case LValue::Heap:
+        emit(RegOp::Store, lv.mReg_, val);
+        break;
+      case LValue::Array:
+        emit(RegOp::ArrayStore, lv.mReg_, lv.mIdx_, val);
+        break;
+    }
+    return val;
+  }
+
+  static RegOp arithmeticOp(BinaryOperatorKind op_code) {
+    switch (op_code) {
+      case BO_Mul:
+        return RegOp::Mul;
+      case BO_Div:
+        return RegOp::Div;
+      case BO_Rem:
+        return RegOp::Rem;
+      case BO_Add:
+        return RegOp::Add;
+      case BO_Sub:
+        return RegOp::Sub;
+      case BO_Shl:
+        return RegOp::Shl;
+      case BO_Shr:
+        return RegOp::Shr;
+      case BO_And:
+        return RegOp::And;
+      case BO_Or:
+        return RegOp::Or;
+      case BO_Xor:
+        return RegOp::Xor;
+      case BO_LT:
+        return RegOp::Lt;
+      case BO_GT:
+        return RegOp::Gt;
+      case BO_LE:
+        return RegOp::Le;
+      case BO_GE:
+        return RegOp::Ge;
+      case BO_EQ:
+        return RegOp::Eq;
+      default:
+        return RegOp::Ne;
+    }
+  }
+
+  /// `l op r` with the pointer scaling of TypeFacts::classify, `dst` is the result register or
+  /// UINT32_MAX for a new temporary
+  uint32_t arithmetic(BinaryOperator *bop, uint32_t l, uint32_t r, uint32_t dst = UINT32_MAX) {
+    auto op_code = TypeFacts::arithmeticOp(bop);
+    bool l_is_ptr = bop->getLHS()->getType()->isPointerType();
+    bool r_is_ptr = bop->getRHS()->getType()->isPointerType();
+    if (TypeFacts::isAdditive(bop)) {
+      if (l_is_ptr && r_is_ptr) {
+        uint32_t bytes = emitValue(RegOp::Sub, l, r);
+        uint32_t size = emitValue(RegOp::LoadImm, 0, 0, Heap::getPtrSize());
+        return emitInto(dst, RegOp::Div, bytes, size);
+      }
+      if (l_is_ptr) {
+        r = emitValue(RegOp::MulImm, r, 0, Heap::getPtrSize());
+      } else if (r_is_ptr) {
+        l = emitValue(RegOp::MulImm, l, 0, Heap::getPtrSize());
+      }
+    }
+    return emitInto(dst, arithmeticOp(op_code), l, r);
+  }
+
+  uint32_t emitInto(uint32_t dst, RegOp op, uint32_t b, uint32_t c, int32_t imm = 0) {
+    if (dst == UINT32_MAX) {
+      return emitValue(op, b, c, imm);
+    }
+    emit(op, dst, b, c, imm);
+    return dst;
+  }
+
+  uint32_t lowerExpr(Expr *expr) {
+    if (!mOk_) {
+      return 0;
+    }
+    switch (expr->getStmtClass()) {
+      case Stmt::IntegerLiteralClass:
+        return emitValue(RegOp::LoadImm, 0, 0, cast<IntegerLiteral>(expr)->getValue().getSExtValue());
+      case Stmt::ParenExprClass:
+        return lowerExpr(cast<ParenExpr>(expr)->getSubExpr());
+      case Stmt::ImplicitCastExprClass:
+      case Stmt::CStyleCastExprClass:
+        return lowerCast(cast<CastExpr>(expr));
+      case Stmt::DeclRefExprClass:
+        /// an array decays to its id, anything else is read through an LValueToRValue cast
+        return load(lowerLValue(expr));
+      case Stmt::UnaryExprOrTypeTraitExprClass: {
+        auto *uexpr = cast<UnaryExprOrTypeTraitExpr>(expr);
+        auto type = uexpr->isArgumentType() ? uexpr->getArgumentType() : QualType();
+        if (uexpr->getKind() != UETT_SizeOf || type.isNull() || !(type->isIntegerType() || type->isPointerType())) {
+          fail(expr, "unsupported");
+          return 0;
+        }
+        return emitValue(RegOp::LoadImm, 0, 0, type->isPointerType() ? Heap::getPtrSize() : sizeof(int));
+      }
+      case Stmt::UnaryOperatorClass:
+        return lowerUnary(cast<UnaryOperator>(expr));
+      case Stmt::BinaryOperatorClass:
+      case Stmt::CompoundAssignOperatorClass:
+        return lowerBinary(cast<BinaryOperator>(expr));
+      case Stmt::ArraySubscriptExprClass:
+        return load(lowerLValue(expr));
+      case Stmt::ConditionalOperatorClass: {
+        auto *cond = cast<ConditionalOperator>(expr);
+        uint32_t res = newVar();
+        size_t to_false = emit(RegOp::JumpIfZero, lowerExpr(cond->getCond()));
+        assign(res, lowerExpr(cond->getTrueExpr()));
+        size_t to_end = emit(RegOp::Jump);
+        patch(to_false, here());
+        assign(res, lowerExpr(cond->getFalseExpr()));
+        patch(to_end, here());
+        return res;
+      }
+      case Stmt::CallExprClass:
+        return lowerCall(cast<CallExpr>(expr));
+      default:
+        fail(expr, "unsupported");
+        return 0;
+    }
+  }
+
+  uint32_t lowerCast(CastExpr *cexpr) {
+    Expr *sub = cexpr->getSubExpr();
+    switch (cexpr->getCastKind()) {
+      case CK_LValueToRValue:
+        return load(lowerLValue(sub));
+      case CK_IntegralToBoolean:
+      case CK_PointerToBoolean:
+        return emitValue(RegOp::Bool, lowerExpr(sub));
+      case CK_ArrayToPointerDecay:
+      case CK_IntegralCast:
+      case CK_NoOp:
+      case CK_BitCast:
+      case CK_NullToPointer:
+      case CK_IntegralToPointer:
+      case CK_PointerToIntegral:
+        return lowerExpr(sub);
+      default:
+        fail(cexpr, "unsupported cast kind of");
+        return 0;
+    }
+  }
+
+  uint32_t lowerUnary(UnaryOperator *uop) {
+    switch (uop->getOpcode()) {
+      case UO_Plus:
+        return lowerExpr(uop->getSubExpr());
+      case UO_Minus:
+        return emitValue(RegOp::Neg, lowerExpr(uop->getSubExpr()));
+      case UO_Not:
+        return emitValue(RegOp::Not, lowerExpr(uop->getSubExpr()));
+      case UO_LNot:
+        return emitValue(RegOp::LNot, lowerExpr(uop->getSubExpr()));
+      case UO_Deref:
+        return load(lowerLValue(uop));
+      case UO_PreInc:
+      case UO_PostInc:
+      case UO_PreDec:
+      case UO_PostDec: {
+        int step = uop->getType()->isPointerType() ? Heap::getPtrSize() : 1;
+        LValue lv = lowerLValue(uop->getSubExpr());
+        uint32_t old = load(lv);
+        if (uop->isPostfix() && lv.mKind_ == LValue::Local) {
+          old = emitValue(RegOp::Move, old);  // the variable is updated in place below
+        }
+        int32_t delta = uop->isIncrementOp() ? step : -step;
+        uint32_t updated = lv.mKind_ == LValue::Local ? emitInto(lv.mReg_, RegOp::AddImm, lv.mReg_, 0, delta)
+                                                      : store(lv, emitValue(RegOp::AddImm, old, 0, delta));
+        return uop->isPrefix() ? updated : old;
+      }
+      default:
+        fail(uop, "unsupported");
+        return 0;
+    }
+  }
+
+  uint32_t lowerBinary(BinaryOperator *bop) {
+    auto op_code = bop->getOpcode();
+    if (op_code == BO_Assign) {
+      LValue lv = lowerLValue(bop->getLHS());
+      return store(lv, lowerExpr(bop->getRHS()));
+    }
+    if (bop->isCompoundAssignmentOp()) {
+      LValue lv = lowerLValue(bop->getLHS());
+      uint32_t rval = lowerExpr(bop->getRHS());
+      if (lv.mKind_ == LValue::Local) {
+        return arithmetic(bop, lv.mReg_, rval, lv.mReg_);  // in place
+      }
+      return store(lv, arithmetic(bop, load(lv), rval));
+    }
+    if (op_code == BO_LAnd || op_code == BO_LOr) {
+      /// res = 1 when the lhs decides an ||, 0 when it decides an &&
+      uint32_t res = newVar();
+      RegOp decided = op_code == BO_LAnd ? RegOp::JumpIfZero : RegOp::JumpIfNonZero;
+      size_t short_circuit = emit(decided, lowerExpr(bop->getLHS()));
+      emit(RegOp::Bool, res, lowerExpr(bop->getRHS()));
+      size_t to_end = emit(RegOp::Jump);
+      patch(short_circuit, here());
+      emit(RegOp::LoadImm, res, 0, 0, op_code == BO_LOr);
+      patch(to_end, here());
+      return res;
+    }
+    if (bop->isCommaOp()) {
+      lowerExpr(bop->getLHS());
+      return lowerExpr(bop->getRHS());
+    }
+    uint32_t lval = lowerExpr(bop->getLHS());
+    uint32_t rval = lowerExpr(bop->getRHS());
+    return arithmetic(bop, lval, rval);
+  }
+
+  uint32_t lowerCall(CallExpr *call) {
+    FunctionDecl *callee = call->getDirectCallee();
+    if (!callee) {
+      fail(call, "indirect");
+      return 0;
+    }
+    std::vector<uint32_t> args;
+    for (Expr *arg : call->arguments()) {
+      args.push_back(lowerExpr(arg));
+    }
+    uint32_t start = mFn_.mArgs_.size();
+    mFn_.mArgs_.insert(mFn_.mArgs_.end(), args.begin(), args.end());
+    if (mEnv_.getBuiltin(callee)) {
+      return emitValue(RegOp::CallBuiltin, start, args.size(), symbol(RegSymbol::Builtin, callee->getName()));
+    }
+    FunctionDecl *def = callee->getDefinition();
+    if (!def || def->getNumParams() != args.size()) {
+      fail(call, "call to a function without a body or with variadic arguments in");
+      return 0;
+    }
+    return emitValue(RegOp::Call, start, args.size(), symbol(RegSymbol::Function, callee->getName(), args.size()));
+  }
+
+  /// Which of A, B and C of `op` are registers, as a bit mask
+  static unsigned regOperands(RegOp op) {
+    switch (op) {
+      case RegOp::LoadImm:
+      case RegOp::NewArray:
+      case RegOp::LoadGlobal:
+      case RegOp::StoreGlobal:
+      case RegOp::JumpIfZero:
+      case RegOp::JumpIfNonZero:
+      case RegOp::Return:
+      case RegOp::Call:
+      case RegOp::CallBuiltin:
+        return 1;
+      case RegOp::Move:
+      case RegOp::AddImm:
+      case RegOp::MulImm:
+      case RegOp::Neg:
+      case RegOp::Not:
+      case RegOp::LNot:
+      case RegOp::Bool:
+      case RegOp::Load:
+      case RegOp::Store:
+        return 3;
+      case RegOp::Jump:
+      case RegOp::ReturnVoid:
+        return 0;
+      default:
+        return 7;
+    }
+  }
+
+  /// calls `fn` on every register operand of `inst`, including the arguments of a call
+  template <typename Fn>
+  void forEachReg(RegInst &inst, Fn fn) {
+    unsigned mask = regOperands(inst.mOp_);
+    if (mask & 1) {
+      fn(inst.mA_);
+    }
+    if (mask & 2) {
+      fn(inst.mB_);
+    }
+    if (mask & 4) {
+      fn(inst.mC_);
+    }
+    if (inst.mOp_ == RegOp::Call || inst.mOp_ == RegOp::CallBuiltin) {
+      for (uint32_t i = inst.mB_; i < inst.mB_ + inst.mC_; i++) {
+        fn(mFn_.mArgs_[i]);
+      }
+    }
+  }
+
+  /// linear scan over the live intervals of the values, in instruction order
+  void allocate() {
+    const uint32_t kNone = UINT32_MAX;
+    std::vector<uint32_t> start(mFn_.mNumValues_, kNone);
+    std::vector<uint32_t> end(mFn_.mNumValues_, 0);
+    for (uint32_t reg : mFn_.mParams_) {
+      start[reg] = 0;
+    }
+    for (uint32_t i = 0; i < mFn_.mCode_.size(); i++) {
+      forEachReg(mFn_.mCode_[i], [&](uint32_t &reg) {
+        start[reg] = std::min(start[reg], i);
+        end[reg] = std::max(end[reg], i);
+      });
+    }
+
+    /// a variable used in a loop keeps its register for the whole loop, its value flows along
+    /// the back edge; extended until nested loops are covered too
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (uint32_t j = 0; j < mFn_.mCode_.size(); j++) {
+        const RegInst &inst = mFn_.mCode_[j];
+        bool jump = inst.mOp_ == RegOp::Jump || inst.mOp_ == RegOp::JumpIfZero || inst.mOp_ == RegOp::JumpIfNonZero;
+        if (!jump || uint32_t(inst.mImm_) > j) {
+          continue;
+        }
+        uint32_t top = inst.mImm_;
+        for (uint32_t reg = 0; reg < mFn_.mNumValues_; reg++) {
+          if (!mIsVar_[reg] || start[reg] == kNone || start[reg] > j || end[reg] < top) {
+            continue;
+          }
+          if (start[reg] > top || end[reg] < j) {
+            start[reg] = std::min(start[reg], top);
+            end[reg] = std::max(end[reg], j);
+            changed = true;
+          }
+        }
+      }
+    }
+
+    std::vector<uint32_t> order;
+    for (uint32_t reg = 0; reg < mFn_.mNumValues_; reg++) {
+      if (start[reg] != kNone) {
+        order.push_back(reg);
+      }
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return start[a] < start[b]; });
+
+    std::vector<uint32_t> assigned(mFn_.mNumValues_, 0);
+    using Active = std::pair<uint32_t, uint32_t>;  // end, register
+    std::priority_queue<Active, std::vector<Active>, std::greater<Active>> active;
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> free_regs;
+    for (uint32_t reg : order) {
+      /// operands are read before the result is written, but a value that ends where another one
+      /// starts may still be read there by the same instruction, so only strictly earlier ends free
+      while (!active.empty() && active.top().first < start[reg]) {
+        free_regs.push(active.top().second);
+        active.pop();
+      }
+      uint32_t phys;
+      if (free_regs.empty()) {
+        phys = mFn_.mNumRegs_++;
+      } else {
+        phys = free_regs.top();
+        free_regs.pop();
+      }
+      assigned[reg] = phys;
+      active.push({end[reg], phys});
+    }
+
+    /// arguments are rewritten through their calls, each exactly once
+    for (RegInst &inst : mFn_.mCode_) {
+      forEachReg(inst, [&](uint32_t &reg) { reg = assigned[reg]; });
+    }
+    for (uint32_t &reg : mFn_.mParams_) {
+      reg = assigned[reg];
+    }
+  }
+
+  Environment &mEnv_;
+  RegFunction &mFn_;
+  llvm::DenseMap<Decl *, uint32_t> mLocals_;
+  llvm::StringMap<int32_t> mSymbolIds_;
+  std::vector<bool> mIsVar_;
+  std::vector<LoopLabels> mLoops_;
+  bool mOk_ = true;
+  std::string mError_;
+};
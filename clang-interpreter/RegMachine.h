@@ -0,0 +1,356 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "clang/AST/Decl.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Environment.h"
+#include "RegCache.h"
+#include "RegIR.h"
+
+using namespace clang;
+
+/// Runs a program as register code instead of walking its AST. The functions reachable from
+/// main are lowered and linked up front; if one of them has no lowering the engine reports why
+/// and the caller runs the program on the AST interpreter instead.
+///
+/// Globals, the heap and the arrays stay in the Environment, after its `init` has evaluated the
+/// initializers of the globals, so builtins see the same state as under the AST interpreter.
+/// Frames are windows of one register stack and calls do not recurse on the C++ stack.
+///
+/// Lowered functions come from a RegCache, which a session keeps from one run to the next.
+class RegEngine {
+ public:
+  RegEngine(Environment &env, TranslationUnitDecl *unit, RegCache &cache) : mEnv_(env), mCache_(cache) {
+    for (Decl *decl : unit->decls()) {
+      if (auto *fdecl = dyn_cast<FunctionDecl>(decl)) {
+        if (fdecl->doesThisDeclarationHaveABody()) {
+          mDefs_[fdecl->getName()] = fdecl;
+        } else if (env.getBuiltin(fdecl)) {
+          mBuiltinNames_.insert(fdecl->getName());
+        }
+      } else if (auto *vdecl = dyn_cast<VarDecl>(decl)) {
+        mGlobals_[vdecl->getName()] = vdecl;
+      }
+    }
+  }
+
+  /// lowers and links everything `entry` can call, false if something has no lowering
+  bool prepare(FunctionDecl *entry) {
+    mEntry_ = link(entry->getName());
+    if (!mEntry_) {
+      llvm::outs() << "regir: " << mError_ << ", running on the AST interpreter\n";
+    }
+    return mEntry_ != nullptr;
+  }
+
+  /// runs main to completion and returns its exit code
+  int run() {
+    /// MALLOC attributes allocations to the current statement, there is none here
+    mEnv_.stackTop().setPC(nullptr);
+    return execute(*mEntry_);
+  }
+
+  void printStats(llvm::raw_ostream &os) const {
+    uint64_t insts = 0;
+    uint64_t values = 0;
+    uint64_t regs = 0;
+    for (const RegFunction *fn : mFunctions_) {
+      insts += fn->mCode_.size();
+      values += fn->mNumValues_;
+      regs += fn->mNumRegs_;
+    }
+    os << "regir: " << mFunctions_.size() << " functions, " << insts << " instructions, " << values << " values in "
+       << regs << " registers, " << mNumExecuted_ << " instructions executed\n";
+  }
+
+ private:
+  /// a RegFunction with its symbols resolved against this program
+  struct Linked {
+    const RegFunction *mFn_ = nullptr;
+    union Target {
+      const Linked *mFunction_;
+      const Builtin *mBuiltin_;
+      int *mGlobal_;
+    };
+    std::vector<Target> mTargets_;
+  };
+
+  struct Activation {
+    const Linked *mFn_;
+    uint32_t mPC_;
+    size_t mBase_;
+    uint32_t mDst_;
+  };
+
+  const Linked *link(llvm::StringRef name) {
+    auto it = mLinked_.find(name);
+    if (it != mLinked_.end()) {
+      return &it->second;
+    }
+    FunctionDecl *fdecl = mDefs_.lookup(name);
+    if (!fdecl) {
+      mError_ = "no definition of " + name.str();
+      return nullptr;
+    }
+    unsigned key = RegCache::key(fdecl);
+    const RegFunction *fn = mCache_.lookup(name, key, [&](const RegFunction &cached) { return resolves(cached); });
+    if (!fn) {
+      auto lowered = std::make_unique<RegFunction>();
+      if (!RegLowering::lower(fdecl, mEnv_, *lowered, mError_)) {
+        return nullptr;
+      }
+      fn = mCache_.insert(name, key, std::move(lowered));
+    }
+    mFunctions_.push_back(fn);
+    /// entered before its callees are linked, so that recursion finds it
+    Linked &linked = mLinked_[name];
+    linked.mFn_ = fn;
+    linked.mTargets_.resize(fn->mSymbols_.size());
+    for (size_t i = 0; i < fn->mSymbols_.size(); i++) {
+      const RegSymbol &sym = fn->mSymbols_[i];
+      switch (sym.mKind_) {
+        case RegSymbol::Function:
+          linked.mTargets_[i].mFunction_ = link(sym.mName_);
+          if (!linked.mTargets_[i].mFunction_) {
+            return nullptr;
+          }
+          break;
+        case RegSymbol::Builtin:
+          linked.mTargets_[i].mBuiltin_ = mEnv_.getBuiltins().lookup(sym.mName_);
+          assert(linked.mTargets_[i].mBuiltin_ && "lowered a call to an unknown builtin");
+          break;
+        case RegSymbol::Global: {
+          VarDecl *vdecl = mGlobals_.lookup(sym.mName_);
+          if (!vdecl || !mEnv_.globalScope().hasDecl(vdecl)) {
+            mError_ = "global " + sym.mName_ + " is not initialized";
+            return nullptr;
+          }
+          /// the global frame is complete after init, its slots do not move
+          linked.mTargets_[i].mGlobal_ = &mEnv_.globalScope().getDeclSlot(vdecl);
+          break;
+        }
+      }
+    }
+    return &linked;
+  }
+
+  /// whether the calls and globals of a lowering made for another parse still are what they were then
+  bool resolves(const RegFunction &fn) const {
+    for (const RegSymbol &sym : fn.mSymbols_) {
+      switch (sym.mKind_) {
+        case RegSymbol::Function: {
+          FunctionDecl *def = mDefs_.lookup(sym.mName_);
+          if (!def || def->getNumParams() != sym.mNumArgs_) {
+            return false;
+          }
+          break;
+        }
+        case RegSymbol::Builtin:
+          if (!mBuiltinNames_.count(sym.mName_)) {
+            return false;
+          }
+          break;
+        case RegSymbol::Global: {
+          VarDecl *vdecl = mGlobals_.lookup(sym.mName_);
+          if (!vdecl || typeKey(vdecl->getType()) != sym.mType_) {
+            return false;
+          }
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  int execute(const Linked &entry) {
+    std::vector<int> &regs = mRegs_;
+    std::vector<Activation> calls;
+    regs.assign(entry.mFn_->mNumRegs_, 0);
+    const Linked *fn = &entry;
+    const RegInst *code = fn->mFn_->mCode_.data();
+    uint32_t pc = 0;
+    size_t base = 0;
+    Heap &heap = mEnv_.getHeap();
+    std::vector<Array> &arrays = mEnv_.getArrays();
+    llvm::SmallVector<int, 8> args;
+
+    while (true) {
+      const RegInst &in = code[pc++];
+      int *r = regs.data() + base;
+      mNumExecuted_++;
+      switch (in.mOp_) {
+        case RegOp::LoadImm:
+          r[in.mA_] = in.mImm_;
+          break;
+        case RegOp::Move:
+          r[in.mA_] = r[in.mB_];
+          break;
+        case RegOp::Add:
+          r[in.mA_] = r[in.mB_] + r[in.mC_];
+          break;
+        case RegOp::Sub:
+          r[in.mA_] = r[in.mB_] - r[in.mC_];
+          break;
+        case RegOp::Mul:
+          r[in.mA_] = r[in.mB_] * r[in.mC_];
+          break;
+        case RegOp::Div:
+          r[in.mA_] = r[in.mB_] / r[in.mC_];
+          break;
+        case RegOp::Rem:
+          r[in.mA_] = r[in.mB_] % r[in.mC_];
+          break;
+        case RegOp::Shl:
+          r[in.mA_] = r[in.mB_] << r[in.mC_];
+          break;
+        case RegOp::Shr:
+          r[in.mA_] = r[in.mB_] >> r[in.mC_];
+          break;
+        case RegOp::And:
+          r[in.mA_] = r[in.mB_] & r[in.mC_];
+          break;
+        case RegOp::Or:
+          r[in.mA_] = r[in.mB_] | r[in.mC_];
+          break;
+        case RegOp::Xor:
+          r[in.mA_] = r[in.mB_] ^ r[in.mC_];
+          break;
+        case RegOp::Lt:
+          r[in.mA_] = r[in.mB_] < r[in.mC_];
+          break;
+        case RegOp::Gt:
+          r[in.mA_] = r[in.mB_] > r[in.mC_];
+          break;
+        case RegOp::Le:
+          r[in.mA_] = r[in.mB_] <= r[in.mC_];
+          break;
+        case RegOp::Ge:
+          r[in.mA_] = r[in.mB_] >= r[in.mC_];
+          break;
+        case RegOp::Eq:
+          r[in.mA_] = r[in.mB_] == r[in.mC_];
+          break;
+        case RegOp::Ne:
+          r[in.mA_] = r[in.mB_] != r[in.mC_];
+          break;
+        case RegOp::AddImm:
+          r[in.mA_] = r[in.mB_] + in.mImm_;
+          break;
+        case RegOp::MulImm:
+          r[in.mA_] = r[in.mB_] * in.mImm_;
+          break;
+        case RegOp::Neg:
+          r[in.mA_] = -r[in.mB_];
+          break;
+        case RegOp::Not:
+          r[in.mA_] = ~r[in.mB_];
+          break;
+        case RegOp::LNot:
+          r[in.mA_] = !r[in.mB_];
+          break;
+        case RegOp::Bool:
+          r[in.mA_] = r[in.mB_] != 0;
+          break;
+        case RegOp::Load:
+          r[in.mA_] = heap.at(r[in.mB_]);
+          break;
+        case RegOp::Store:
+          heap.at(r[in.mA_]) = r[in.mB_];
+          break;
+        case RegOp::ArrayLoad:
+          r[in.mA_] = arrays[r[in.mB_]].at(r[in.mC_]);
+          break;
+        case RegOp::ArrayStore:
+          arrays[r[in.mA_]].at(r[in.mB_]) = r[in.mC_];
+          break;
+        case RegOp::NewArray:
+          arrays.emplace_back(in.mImm_, calls.size() + 1);
+          r[in.mA_] = arrays.size() - 1;
+          break;
+        case RegOp::LoadGlobal:
+          r[in.mA_] = *fn->mTargets_[in.mImm_].mGlobal_;
+          break;
+        case RegOp::StoreGlobal:
+          *fn->mTargets_[in.mImm_].mGlobal_ = r[in.mA_];
+          break;
+        case RegOp::Jump:
+          pc = in.mImm_;
+          break;
+        case RegOp::JumpIfZero:
+          if (!r[in.mA_]) {
+            pc = in.mImm_;
+          }
+          break;
+        case RegOp::JumpIfNonZero:
+          if (r[in.mA_]) {
+            pc = in.mImm_;
+          }
+          break;
+        case RegOp::CallBuiltin: {
+          const Builtin *builtin = fn->mTargets_[in.mImm_].mBuiltin_;
+          const uint32_t *arg_regs = fn->mFn_->mArgs_.data() + in.mB_;
+          args.clear();
+          for (uint32_t i = 0; i < in.mC_; i++) {
+            args.push_back(r[arg_regs[i]]);
+          }
+          int val = mEnv_.callBuiltin(*builtin, args);
+          if (builtin->mReturnsValue_) {
+            regs[base + in.mA_] = val;
+          }
+          break;
+        }
+        case RegOp::Call: {
+          const Linked *callee = fn->mTargets_[in.mImm_].mFunction_;
+          size_t callee_base = regs.size();
+          regs.resize(callee_base + callee->mFn_->mNumRegs_, 0);  // fresh registers are zero
+          const uint32_t *arg_regs = fn->mFn_->mArgs_.data() + in.mB_;
+          const uint32_t *params = callee->mFn_->mParams_.data();
+          for (uint32_t i = 0; i < in.mC_; i++) {
+            regs[callee_base + params[i]] = regs[base + arg_regs[i]];
+          }
+          calls.push_back({fn, pc, base, in.mA_});
+          fn = callee;
+          code = fn->mFn_->mCode_.data();
+          pc = 0;
+          base = callee_base;
+          break;
+        }
+        case RegOp::Return:
+        case RegOp::ReturnVoid: {
+          int val = in.mOp_ == RegOp::Return ? r[in.mA_] : 0;
+          regs.resize(base);
+          if (calls.empty()) {
+            return val;
+          }
+          const Activation &caller = calls.back();
+          fn = caller.mFn_;
+          code = fn->mFn_->mCode_.data();
+          pc = caller.mPC_;
+          base = caller.mBase_;
+          regs[base + caller.mDst_] = val;
+          calls.pop_back();
+          break;
+        }
+      }
+    }
+  }
+
+  Environment &mEnv_;
+  RegCache &mCache_;
+  llvm::StringMap<FunctionDecl *> mDefs_;
+  llvm::StringSet<> mBuiltinNames_;
+  llvm::StringMap<VarDecl *> mGlobals_;
+  std::vector<const RegFunction *> mFunctions_;
+  llvm::StringMap<Linked> mLinked_;
+  const Linked *mEntry_ = nullptr;
+  std::string mError_;
+  std::vector<int> mRegs_;
+  uint64_t mNumExecuted_ = 0;
+};
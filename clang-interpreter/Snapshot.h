@@ -0,0 +1,231 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "ByteReader.h"
+#include "Environment.h"
+
+using namespace clang;
+
+/// Gives every Decl and Stmt of a translation unit a stable number, so that the
+/// pointer-keyed interpreter state can be written out and mapped back onto the AST
+/// of another run over the same program.
+class AstIndex : public RecursiveASTVisitor<AstIndex> {
+ public:
+  explicit AstIndex(TranslationUnitDecl *unit) { TraverseDecl(unit); }
+
+  bool VisitDecl(Decl *decl) {
+    mDeclIds_[decl] = mDecls_.size();
+    mDecls_.push_back(decl);
+    return true;
+  }
+
+  bool VisitStmt(Stmt *stmt) {
+    mStmtIds_[stmt] = mStmts_.size();
+    mStmts_.push_back(stmt);
+    return true;
+  }
+
+  /// ids are 1-based, 0 stands for "no node" (e.g., a frame without PC) or "unknown"
+  unsigned getId(Decl *decl) const {
+    auto it = mDeclIds_.find(decl);
+    return it == mDeclIds_.end() ? 0 : it->second + 1;
+  }
+  unsigned getId(Stmt *stmt) const {
+    auto it = mStmtIds_.find(stmt);
+    return it == mStmtIds_.end() ? 0 : it->second + 1;
+  }
+
+  Decl *getDecl(unsigned id) const { return id && id <= mDecls_.size() ? mDecls_[id - 1] : nullptr; }
+  Stmt *getStmt(unsigned id) const { return id && id <= mStmts_.size() ? mStmts_[id - 1] : nullptr; }
+
+ private:
+  std::vector<Decl *> mDecls_;
+  std::vector<Stmt *> mStmts_;
+  llvm::DenseMap<Decl *, unsigned> mDeclIds_;
+  llvm::DenseMap<Stmt *, unsigned> mStmtIds_;
+};
+
+/// Binary snapshot of an Environment, all integers are LEB128 encoded:
+///
+///   magic "CISN", version, program fingerprint (xxhash64 of the main file), resume index
+///   heap:   size, raw bytes, #live allocations, { address, size, MALLOC call id }
+///   arrays: count, { scope, size, values... }
+///   frames: count, { pc, #decls, { decl id, value }..., #stmts, { stmt id, value }... }
+///
+/// The resume index is the index of the top-level statement of main to continue from.
+class Snapshot {
+ public:
+  static constexpr char kMagic[] = "CISN";
+  static const unsigned kVersion = 2;
+
+  static uint64_t fingerprint(llvm::StringRef program) { return llvm::xxHash64(program); }
+
+  static bool save(const std::string &path, Environment &env, const AstIndex &index, uint64_t fingerprint,
+                   unsigned resume) {
+    std::string data;
+    llvm::raw_string_ostream os(data);
+    os << kMagic;
+    llvm::encodeULEB128(kVersion, os);
+    llvm::encodeULEB128(fingerprint, os);
+    llvm::encodeULEB128(resume, os);
+
+    llvm::StringRef heap = env.getHeap().getContents();
+    llvm::encodeULEB128(heap.size(), os);
+    os << heap;
+    const auto &live = env.getHeap().getLiveAllocations();
+    llvm::encodeULEB128(live.size(), os);
+    for (const auto &entry : live) {
+      llvm::encodeULEB128(entry.first, os);
+      llvm::encodeULEB128(entry.second.mSize_, os);
+      llvm::encodeULEB128(entry.second.mSite_ ? index.getId(entry.second.mSite_) : 0, os);
+    }
+
+    llvm::encodeULEB128(env.getArrays().size(), os);
+    for (const Array &arr : env.getArrays()) {
+      llvm::encodeULEB128(arr.getScope(), os);
+      llvm::encodeULEB128(arr.getValues().size(), os);
+      for (int val : arr.getValues()) {
+        llvm::encodeSLEB128(val, os);
+      }
+    }
+
+    llvm::encodeULEB128(env.getStack().size(), os);
+    for (StackFrame &frame : env.getStack()) {
+      llvm::encodeULEB128(frame.getPC() ? index.getId(frame.getPC()) : 0, os);
+      llvm::encodeULEB128(frame.getDecls().size(), os);
+      for (const auto &entry : frame.getDecls()) {
+        unsigned id = index.getId(entry.first);
+        if (!id) {
+          llvm::errs() << "snapshot: cannot index decl\n";
+          return false;
+        }
+        llvm::encodeULEB128(id, os);
+        llvm::encodeSLEB128(entry.second, os);
+      }
+      llvm::encodeULEB128(frame.getStmts().size(), os);
+      for (const auto &entry : frame.getStmts()) {
+        unsigned id = index.getId(entry.first);
+        if (!id) {
+          llvm::errs() << "snapshot: cannot index stmt\n";
+          return false;
+        }
+        llvm::encodeULEB128(id, os);
+        llvm::encodeSLEB128(entry.second, os);
+      }
+    }
+    os.flush();
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec);
+    if (ec) {
+      llvm::errs() << "snapshot: cannot write " << path << ": " << ec.message() << "\n";
+      return false;
+    }
+    out << data;
+    return true;
+  }
+
+  /// replaces the state of `env` with the snapshot at `path`, returns false if the snapshot is
+  /// unreadable or was taken from a different program
+  static bool load(const std::string &path, Environment &env, const AstIndex &index, uint64_t fingerprint,
+                   unsigned &resume) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+      llvm::errs() << "snapshot: cannot read " << path << ": " << buffer.getError().message() << "\n";
+      return false;
+    }
+    ByteReader reader((*buffer)->getBuffer());
+    if (!reader.expect(kMagic) || reader.u() != kVersion) {
+      llvm::errs() << "snapshot: " << path << " is not a snapshot\n";
+      return false;
+    }
+    if (reader.u() != fingerprint) {
+      llvm::errs() << "snapshot: " << path << " was taken from a different program\n";
+      return false;
+    }
+    resume = reader.u();
+
+    uint64_t heap_size = reader.u();
+    if (heap_size > Heap::getCapacity()) {
+      reader.fail();
+    }
+    llvm::StringRef heap = reader.bytes(heap_size);
+    struct LiveAllocation {
+      Heap::HeapAddr mAddr_;
+      int mSize_;
+      Stmt *mSite_;
+    };
+    std::vector<LiveAllocation> live;
+    for (uint64_t n = reader.u(); n && reader.ok(); n--) {
+      uint64_t addr = reader.u();
+      uint64_t size = reader.u();
+      if (addr > heap_size || size > heap_size - addr) {  // [addr, addr + size) must lie in the heap
+        reader.fail();
+        break;
+      }
+      live.push_back({Heap::HeapAddr(addr), int(size), index.getStmt(reader.u())});
+    }
+
+    std::vector<Array> arrays;
+    for (uint64_t n = reader.u(); n && reader.ok(); n--) {
+      int scope = reader.u();
+      uint64_t size = reader.u();
+      if (size > reader.remaining()) {  // every value takes at least one byte
+        reader.fail();
+        break;
+      }
+      std::vector<int> values(size);
+      for (int &val : values) {
+        val = reader.s();
+      }
+      arrays.emplace_back(std::move(values), scope);
+    }
+
+    std::vector<StackFrame> stack;
+    for (uint64_t n = reader.u(); n && reader.ok(); n--) {
+      StackFrame frame;
+      if (unsigned pc = reader.u()) {
+        frame.setPC(index.getStmt(pc));
+      }
+      for (uint64_t m = reader.u(); m && reader.ok(); m--) {
+        Decl *decl = index.getDecl(reader.u());
+        int val = reader.s();
+        if (!decl) {
+          reader.fail();
+          break;
+        }
+        frame.bindDecl(decl, val);
+      }
+      for (uint64_t m = reader.u(); m && reader.ok(); m--) {
+        Stmt *stmt = index.getStmt(reader.u());
+        int val = reader.s();
+        if (!stmt) {
+          reader.fail();
+          break;
+        }
+        frame.bindStmt(stmt, val);
+      }
+      stack.push_back(std::move(frame));
+    }
+
+    if (!reader.ok() || stack.empty() || !env.getHeap().setContents(heap)) {
+      llvm::errs() << "snapshot: " << path << " is truncated or corrupted\n";
+      return false;
+    }
+    for (const LiveAllocation &alloc : live) {
+      env.getHeap().restoreAllocation(alloc.mAddr_, alloc.mSize_, alloc.mSite_);
+    }
+    env.getArrays() = std::move(arrays);
+    env.getStack() = std::move(stack);
+    return true;
+  }
+};
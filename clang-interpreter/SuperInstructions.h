@@ -0,0 +1,176 @@
+#pragma once
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace clang;
+
+/// Statement shapes that are executed as one fused operation instead of a walk over their subtree
+enum class FusedKind : uint8_t {
+  UpdateVar,   /// x = x op (C | y), x op= (C | y), ++x, x++, --x, x--
+  ArrayStore,  /// a[i | C] = expr
+  CmpConst,    /// x cmp C
+  DerefStore,  /// *p = expr
+  NumKinds,
+};
+
+struct FusedOp {
+  FusedKind mKind_;
+  BinaryOperatorKind mOp_;  /// arithmetic or comparison op of UpdateVar / CmpConst
+  Decl *mVar_;              /// x, a or p
+  Decl *mOperand_;          /// y of UpdateVar, i of ArrayStore, nullptr when the operand is the constant
+  int mImm_;                /// C
+  Expr *mValue_;            /// right hand side of the stores
+  bool mPostfix_;           /// x++ and x-- evaluate to the value before the update
+};
+
+/// Recognizes the fused shapes once, when the program is loaded.
+class SuperInstructions : public RecursiveASTVisitor<SuperInstructions> {
+ public:
+  void build(TranslationUnitDecl *unit) { TraverseDecl(unit); }
+
+  const FusedOp *lookup(Expr *expr) const {
+    auto it = mOps_.find(expr);
+    return it == mOps_.end() ? nullptr : &it->second;
+  }
+
+  void count(FusedKind kind) { mCounts_[static_cast<int>(kind)]++; }
+
+  void printStats(llvm::raw_ostream &os) const {
+    static const char *const kNames[] = {"update-var", "array-store", "cmp-const", "deref-store"};
+    os << "superinstructions: " << mOps_.size() << " sites\n";
+    for (int i = 0; i < static_cast<int>(FusedKind::NumKinds); i++) {
+      os << "  " << kNames[i] << ": " << mCounts_[i] << "\n";
+    }
+  }
+
+  bool VisitBinaryOperator(BinaryOperator *bop) {
+    FusedOp op = {};
+    if (matchCmpConst(bop, op) || matchUpdateVar(bop, op) || matchArrayStore(bop, op) || matchDerefStore(bop, op)) {
+      mOps_[bop] = op;
+    }
+    return true;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *uop) {
+    FusedOp op = {};
+    if (uop->isIncrementDecrementOp() && (op.mVar_ = intVar(uop->getSubExpr()))) {
+      op.mKind_ = FusedKind::UpdateVar;
+      op.mOp_ = uop->isIncrementOp() ? BO_Add : BO_Sub;
+      op.mImm_ = 1;
+      op.mPostfix_ = uop->isPostfix();
+      mOps_[uop] = op;
+    }
+    return true;
+  }
+
+ private:
+  /// a local or global int variable read through its DeclRefExpr
+  static VarDecl *intVar(Expr *expr) {
+    auto *ref = dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts());
+    if (!ref) {
+      return nullptr;
+    }
+    auto *var = dyn_cast<VarDecl>(ref->getFoundDecl());
+    return var && var->getType()->isIntegerType() ? var : nullptr;
+  }
+
+  static bool intConst(Expr *expr, int &val) {
+    auto *lit = dyn_cast<IntegerLiteral>(expr->IgnoreParenImpCasts());
+    if (!lit) {
+      return false;
+    }
+    val = lit->getValue().getSExtValue();
+    return true;
+  }
+
+  bool matchCmpConst(BinaryOperator *bop, FusedOp &op) {
+    if (!bop->isComparisonOp()) {
+      return false;
+    }
+    op.mVar_ = intVar(bop->getLHS());
+    if (!op.mVar_ || !intConst(bop->getRHS(), op.mImm_)) {
+      return false;
+    }
+    op.mKind_ = FusedKind::CmpConst;
+    op.mOp_ = bop->getOpcode();
+    return true;
+  }
+
+  static bool isUpdateOp(BinaryOperatorKind op_code) {
+    return op_code == BO_Add || op_code == BO_Sub || op_code == BO_Mul;
+  }
+
+  bool matchUpdateVar(BinaryOperator *bop, FusedOp &op) {
+    auto *lhs = dyn_cast<DeclRefExpr>(bop->getLHS());
+    if (!lhs) {
+      return false;
+    }
+    op.mVar_ = intVar(lhs);
+    Expr *operand = nullptr;
+    if (bop->isCompoundAssignmentOp()) {
+      op.mOp_ = BinaryOperator::getOpForCompoundAssignment(bop->getOpcode());
+      operand = bop->getRHS();
+    } else if (bop->getOpcode() == BO_Assign) {
+      auto *rhs = dyn_cast<BinaryOperator>(bop->getRHS()->IgnoreParenImpCasts());
+      if (!rhs || intVar(rhs->getLHS()) != op.mVar_) {
+        return false;
+      }
+      op.mOp_ = rhs->getOpcode();
+      operand = rhs->getRHS();
+    }
+    if (!op.mVar_ || !operand || !isUpdateOp(op.mOp_)) {
+      return false;
+    }
+    op.mOperand_ = intVar(operand);
+    if (!op.mOperand_ && !intConst(operand, op.mImm_)) {
+      return false;
+    }
+    op.mKind_ = FusedKind::UpdateVar;
+    return true;
+  }
+
+  bool matchArrayStore(BinaryOperator *bop, FusedOp &op) {
+    if (bop->getOpcode() != BO_Assign) {
+      return false;
+    }
+    auto *arrsub = dyn_cast<ArraySubscriptExpr>(bop->getLHS());
+    if (!arrsub) {
+      return false;
+    }
+    auto *base = dyn_cast<DeclRefExpr>(arrsub->getBase()->IgnoreParenImpCasts());
+    if (!base || !base->getType()->isConstantArrayType()) {
+      return false;
+    }
+    op.mOperand_ = intVar(arrsub->getIdx());
+    if (!op.mOperand_ && !intConst(arrsub->getIdx(), op.mImm_)) {
+      return false;
+    }
+    op.mKind_ = FusedKind::ArrayStore;
+    op.mVar_ = base->getFoundDecl();
+    op.mValue_ = bop->getRHS();
+    return true;
+  }
+
+  bool matchDerefStore(BinaryOperator *bop, FusedOp &op) {
+    if (bop->getOpcode() != BO_Assign) {
+      return false;
+    }
+    auto *deref = dyn_cast<UnaryOperator>(bop->getLHS()->IgnoreParens());
+    if (!deref || deref->getOpcode() != UO_Deref) {
+      return false;
+    }
+    auto *ptr = dyn_cast<DeclRefExpr>(deref->getSubExpr()->IgnoreParenImpCasts());
+    if (!ptr || !ptr->getType()->isPointerType()) {
+      return false;
+    }
+    op.mKind_ = FusedKind::DerefStore;
+    op.mVar_ = ptr->getFoundDecl();
+    op.mValue_ = bop->getRHS();
+    return true;
+  }
+
+  llvm::DenseMap<Expr *, FusedOp> mOps_;
+  uint64_t mCounts_[static_cast<int>(FusedKind::NumKinds)] = {};
+};
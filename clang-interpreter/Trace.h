@@ -0,0 +1,170 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Builtins.h"
+#include "ByteReader.h"
+
+/// Binary log of the builtin calls of one run, all integers are LEB128 encoded:
+///
+///   magic "CITR", version, program fingerprint (xxhash64 of the main file)
+///   calls:  { builtin id, [name length, name,] arguments..., result }...
+///
+/// Builtin ids are numbered in order of first use, the name follows an id the first time it is
+/// used. A call has as many arguments as its builtin has parameters, and a result only if the
+/// builtin returns a value.
+///
+/// On replay, external builtins (those that read or write the terminal) are not run, they return
+/// the recorded result. The others run as usual and their arguments and results are checked
+/// against the trace, so a replay that diverges from the recording is reported.
+class Trace {
+ public:
+  static constexpr char kMagic[] = "CITR";
+  static const unsigned kVersion = 1;
+
+  static std::unique_ptr<Trace> record(const std::string &path, uint64_t fingerprint) {
+    std::error_code ec;
+    auto out = std::make_unique<llvm::raw_fd_ostream>(path, ec);
+    if (ec) {
+      llvm::errs() << "trace: cannot write " << path << ": " << ec.message() << "\n";
+      return nullptr;
+    }
+    *out << kMagic;
+    llvm::encodeULEB128(kVersion, *out);
+    llvm::encodeULEB128(fingerprint, *out);
+    std::unique_ptr<Trace> trace(new Trace(path));
+    trace->mOut_ = std::move(out);
+    return trace;
+  }
+
+  static std::unique_ptr<Trace> replay(const std::string &path, uint64_t fingerprint) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+      llvm::errs() << "trace: cannot read " << path << ": " << buffer.getError().message() << "\n";
+      return nullptr;
+    }
+    std::unique_ptr<Trace> trace(new Trace(path));
+    trace->mIn_ = std::move(*buffer);
+    ByteReader &reader = trace->mReader_;
+    reader = ByteReader(trace->mIn_->getBuffer());
+    if (!reader.expect(kMagic) || reader.u() != kVersion) {
+      llvm::errs() << "trace: " << path << " is not a trace\n";
+      return nullptr;
+    }
+    if (reader.u() != fingerprint) {
+      llvm::errs() << "trace: " << path << " was recorded from a different program\n";
+      return nullptr;
+    }
+    return trace;
+  }
+
+  /// runs, or on replay feeds back, one builtin call
+  int call(Environment &env, const Builtin &builtin, llvm::ArrayRef<int> args) {
+    if (mOut_) {
+      int val = builtin.mFn_(env, args);
+      writeCall(builtin, args, val);
+      return val;
+    }
+    if (mDiverged_) {
+      return builtin.mFn_(env, args);
+    }
+    return replayCall(env, builtin, args);
+  }
+
+  /// flushes a recording, or checks that a replay consumed the whole trace
+  bool finish() {
+    if (mOut_) {
+      mOut_->flush();
+      return !mOut_->has_error();
+    }
+    if (!mDiverged_ && !mReader_.atEnd()) {
+      diverge("the program made fewer builtin calls than recorded");
+    }
+    return !mDiverged_;
+  }
+
+ private:
+  explicit Trace(std::string path) : mPath_(std::move(path)) {}
+
+  void writeCall(const Builtin &builtin, llvm::ArrayRef<int> args, int val) {
+    auto it = mIds_.try_emplace(builtin.mName_, mIds_.size());
+    llvm::encodeULEB128(it.first->second, *mOut_);
+    if (it.second) {
+      llvm::encodeULEB128(builtin.mName_.size(), *mOut_);
+      *mOut_ << builtin.mName_;
+    }
+    for (int arg : args) {
+      llvm::encodeSLEB128(arg, *mOut_);
+    }
+    if (builtin.mReturnsValue_) {
+      llvm::encodeSLEB128(val, *mOut_);
+    }
+    /// keep the input a failing run consumed
+    if (builtin.mExternal_) {
+      mOut_->flush();
+    }
+  }
+
+  int replayCall(Environment &env, const Builtin &builtin, llvm::ArrayRef<int> args) {
+    uint64_t index = mCalls_++;
+    if (mReader_.atEnd()) {
+      diverge("the program made more builtin calls than recorded");
+      return call(env, builtin, args);
+    }
+    uint64_t id = mReader_.u();
+    if (id == mNames_.size()) {
+      uint64_t len = mReader_.u();
+      mNames_.push_back(mReader_.bytes(len));
+    }
+    if (!mReader_.ok() || id >= mNames_.size() || mNames_[id] != builtin.mName_) {
+      diverge("call " + std::to_string(index) + " is not to " + builtin.mName_.str());
+      return call(env, builtin, args);
+    }
+    for (int arg : args) {
+      if (mReader_.s() != arg) {
+        diverge("call " + std::to_string(index) + " to " + builtin.mName_.str() + " has other arguments");
+        return call(env, builtin, args);
+      }
+    }
+    int recorded = builtin.mReturnsValue_ ? mReader_.s() : 0;
+    if (!mReader_.ok()) {
+      diverge("the trace is truncated");
+      return call(env, builtin, args);
+    }
+    if (builtin.mExternal_) {
+      return recorded;
+    }
+    int val = builtin.mFn_(env, args);
+    if (builtin.mReturnsValue_ && val != recorded) {
+      diverge("call " + std::to_string(index) + " to " + builtin.mName_.str() + " returned another value");
+    }
+    return val;
+  }
+
+  /// reports the first difference from the recording, the rest of the run executes live, also
+  /// the external builtins
+  void diverge(const std::string &why) {
+    llvm::errs() << "trace: replay of " << mPath_ << " diverged: " << why << "\n";
+    mDiverged_ = true;
+  }
+
+  std::string mPath_;
+
+  /// recording
+  std::unique_ptr<llvm::raw_fd_ostream> mOut_;
+  llvm::StringMap<uint64_t> mIds_;
+
+  /// replay
+  std::unique_ptr<llvm::MemoryBuffer> mIn_;
+  ByteReader mReader_;
+  bool mDiverged_ = false;
+  uint64_t mCalls_ = 0;
+  std::vector<llvm::StringRef> mNames_;
+};
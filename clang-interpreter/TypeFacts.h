@@ -0,0 +1,115 @@
+#pragma once
+
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "llvm/ADT/DenseMap.h"
+
+using namespace clang;
+
+/// What an operator or reference does, decided once from the static types of its operands
+enum class OpKind : uint8_t {
+  IntAdd,       /// int + int
+  IntSub,       /// int - int
+  PtrAddInt,    /// ptr + int, the int is scaled to bytes
+  IntAddPtr,    /// int + ptr
+  PtrSubInt,    /// ptr - int
+  PtrSubPtr,    /// ptr - ptr, the distance in elements
+  IntStep,      /// ++ or -- of an int
+  PtrStep,      /// ++ or -- of a pointer, steps by one element
+  IntCast,      /// a cast to an integer type, passes the value through
+  NoOpCast,     /// a cast that produces no value the interpreter tracks
+  ValueRef,     /// a reference to an int, pointer or array variable
+  FunctionRef,  /// a reference to a function, it has no value
+  Unsupported,  /// anything else
+};
+
+/// Classifies additive operators (also `+=` and `-=`), increments and decrements, casts and
+/// DeclRefExprs so that execution dispatches on a tag instead of querying clang's type system.
+/// Everything in the program is classified when it is loaded, nodes that were not reached then
+/// are classified on first use.
+class TypeFacts : public RecursiveASTVisitor<TypeFacts> {
+ public:
+  void build(TranslationUnitDecl *unit) { TraverseDecl(unit); }
+
+  bool VisitBinaryOperator(BinaryOperator *bop) {
+    if (isAdditive(bop)) {
+      get(bop);
+    }
+    return true;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *uop) {
+    if (uop->isIncrementDecrementOp()) {
+      get(uop);
+    }
+    return true;
+  }
+
+  bool VisitCastExpr(CastExpr *expr) {
+    get(expr);
+    return true;
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *expr) {
+    get(expr);
+    return true;
+  }
+
+  OpKind get(BinaryOperator *bop) { return lookup(bop, [&] { return classify(bop); }); }
+  OpKind get(UnaryOperator *uop) { return lookup(uop, [&] { return classify(uop); }); }
+  OpKind get(CastExpr *expr) { return lookup(expr, [&] { return classify(expr); }); }
+  OpKind get(DeclRefExpr *expr) { return lookup(expr, [&] { return classify(expr); }); }
+
+  /// the arithmetic op of `bop`, i.e. `+` for both `a + b` and `a += b`
+  static BinaryOperatorKind arithmeticOp(BinaryOperator *bop) {
+    auto op_code = bop->getOpcode();
+    return bop->isCompoundAssignmentOp() ? BinaryOperator::getOpForCompoundAssignment(op_code) : op_code;
+  }
+
+  static bool isAdditive(BinaryOperator *bop) { return BinaryOperator::isAdditiveOp(arithmeticOp(bop)); }
+
+ private:
+  template <typename Fn>
+  OpKind lookup(Stmt *stmt, Fn classifier) {
+    auto it = mKinds_.find(stmt);
+    if (it != mKinds_.end()) {
+      return it->second;
+    }
+    OpKind kind = classifier();
+    mKinds_[stmt] = kind;
+    return kind;
+  }
+
+  static OpKind classify(BinaryOperator *bop) {
+    bool l_is_ptr = bop->getLHS()->getType()->isPointerType();
+    bool r_is_ptr = bop->getRHS()->getType()->isPointerType();
+    bool is_add = arithmeticOp(bop) == BO_Add;
+    if (l_is_ptr && r_is_ptr) {
+      return OpKind::PtrSubPtr;
+    }
+    if (l_is_ptr) {
+      return is_add ? OpKind::PtrAddInt : OpKind::PtrSubInt;
+    }
+    if (r_is_ptr) {
+      return OpKind::IntAddPtr;
+    }
+    return is_add ? OpKind::IntAdd : OpKind::IntSub;
+  }
+
+  static OpKind classify(UnaryOperator *uop) {
+    return uop->getType()->isPointerType() ? OpKind::PtrStep : OpKind::IntStep;
+  }
+
+  static OpKind classify(CastExpr *expr) {
+    return expr->getType()->isIntegerType() ? OpKind::IntCast : OpKind::NoOpCast;
+  }
+
+  static OpKind classify(DeclRefExpr *expr) {
+    auto type = expr->getType();
+    if (type->isIntegerType() || type->isArrayType() || type->isPointerType()) {
+      return OpKind::ValueRef;
+    }
+    return type->isFunctionType() ? OpKind::FunctionRef : OpKind::Unsupported;
+  }
+
+  llvm::DenseMap<Stmt *, OpKind> mKinds_;
+};
@@ -1,4 +1,6 @@
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 
 int GET() {
   int x;
@@ -7,4 +9,20 @@ int GET() {
 }
 void* MALLOC(int sz) { return malloc(sz); }
 void FREE(void* ptr) { free(ptr); }
-void PRINT(int x) { printf("%d", x); }
\ No newline at end of file
+void PRINT(int x) { printf("%d", x); }
+void CHECKPOINT() {}
+void MEMCPY(void* dst, void* src, int n) { memmove(dst, src, n); }
+void MEMSET(void* dst, int val, int n) { memset(dst, val, n); }
+static int compareInt(const void* a, const void* b) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+void SORT(int* ints, int n) { qsort(ints, n, sizeof(int), compareInt); }
+int HASH(int* ints, int n) {
+  const unsigned char* bytes = (const unsigned char*)ints;
+  unsigned h = 2166136261u;
+  for (int i = 0; i < n * (int)sizeof(int); i++) {
+    h = (h ^ bytes[i]) * 16777619u;
+  }
+  return (int)h;
+}
\ No newline at end of file
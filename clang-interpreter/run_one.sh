@@ -1,5 +1,3 @@
 #!/bin/bash
 
-code=$(cat $1 | tr '\n' ' ')
-echo $code
-./build/clang-interpreter "$code"
\ No newline at end of file
+./build/clang-interpreter "$1"
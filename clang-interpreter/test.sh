@@ -1,39 +1,13 @@
 #!/bin/bash
 
-mkdir build
+mkdir -p build
 cd build
 cmake ..
 make
-cd .. 
+cd ..
 
-CLANG_INTERPRETER="./build/clang-interpreter"
-LIBCODE="buildin.cpp"
-
-TEST_DIR="./test"
-test_file_list=$(ls $TEST_DIR)
-
-total=$(echo "$test_file_list" | wc -w)
-
-correct=0
-
-echo "total test cases: $total"
-
-for file in $test_file_list; do
-    echo "testing $file"
-    filename="$TEST_DIR/$file"
-    cppcode=$(cat $filename)
-
-    # make $correct as the user input, you can change it if you like
-
-    res=$(echo $correct | ($CLANG_INTERPRETER "$cppcode" 2>&1 > /dev/null))
-    gcc $filename $LIBCODE -o x.out
-    expected=$(echo $correct | ./x.out)
-
-    if [[ "$res" = "$expected" ]]; then
-        echo "$file passed"
-        correct=$(($correct + 1))
-    fi
-done
-rm x.out
-rm -fr build
-echo "$correct/$total"
\ No newline at end of file
+# the reference side is JIT-compiled in-process from the test and buildin.cpp,
+# see InterpreterTest.cpp; pass -j N to limit the number of tests run in parallel
+./build/clang-interpreter-test --lib buildin.cpp "$@" ./test/*.cpp
+# and again with the functions lowered to register code
+./build/clang-interpreter-test --lib buildin.cpp --regir "$@" ./test/*.cpp
@@ -0,0 +1,32 @@
+extern int GET();
+extern void *MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern void MEMCPY(void *, void *, int);
+extern void MEMSET(void *, int, int);
+extern void SORT(int *, int);
+extern int HASH(int *, int);
+
+int main() {
+  int *a;
+  int *b;
+  int i;
+  a = (int *)MALLOC(sizeof(int) * 8);
+  b = (int *)MALLOC(sizeof(int) * 8);
+  MEMSET(b, 0, sizeof(int) * 8);
+  PRINT(*(b + 7));
+  for (i = 0; i < 8; i = i + 1) {
+    *(a + i) = (i * 5) % 8;
+  }
+  MEMCPY(b, a, sizeof(int) * 8);
+  SORT(b, 8);
+  for (i = 0; i < 8; i = i + 1) {
+    PRINT(*(b + i));
+  }
+  PRINT(*(a + 1));
+  PRINT(HASH(b, 8) == HASH(a, 8));
+  PRINT(HASH(b, 8));
+  FREE(a);
+  FREE(b);
+  return 0;
+}
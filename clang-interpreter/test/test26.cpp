@@ -0,0 +1,70 @@
+extern int GET();
+extern void *MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int g;
+
+int main() {
+  int a[4];
+  int *p;
+  int *q;
+  int i;
+  int x;
+  int y;
+
+  x = 100;
+  x += 7;
+  x -= 2;
+  x *= 3;
+  x /= 4;
+  PRINT(x);
+  x %= 10;
+  PRINT(x);
+  x <<= 3;
+  x |= 5;
+  x &= 29;
+  x ^= 6;
+  x >>= 1;
+  PRINT(x);
+  PRINT(-17 / 5);
+
+  y = x++;
+  PRINT(y);
+  PRINT(++x);
+  PRINT(x--);
+  PRINT(--x);
+
+  g = 0;
+  for (i = 0; i < 10; i++) {
+    g += i;
+  }
+  PRINT(g);
+  for (i = 10; i > 0; i -= 3) {
+    ++g;
+  }
+  PRINT(g);
+
+  for (i = 0; i < 4; ++i) {
+    a[i] = i;
+    a[i] *= a[i];
+  }
+  a[2]++;
+  --a[3];
+  PRINT(a[0] + a[1] + a[2] + a[3]);
+
+  p = (int *)MALLOC(sizeof(int) * 4);
+  q = p;
+  for (i = 0; i < 4; i++) {
+    *q = i;
+    *q += 10;
+    q++;
+  }
+  q -= 2;
+  (*q)--;
+  PRINT(*q);
+  PRINT(q - p);
+  PRINT(*(p + 3));
+  FREE(p);
+  return 0;
+}
@@ -0,0 +1,70 @@
+extern int GET();
+extern void *MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int calls;
+int table[6];
+
+int fib(int n) {
+  calls = calls + 1;
+  if (n < 2) {
+    return n;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+int mix(int a, int b, int c, int d) {
+  int t;
+  int u;
+  t = a * b - c;
+  u = t + d * (a - b);
+  return (t ^ u) + (u % 7) * (c + d);
+}
+
+int sum(int *p, int n) {
+  int s;
+  int i;
+  s = 0;
+  for (i = 0; i < n; i++) {
+    s += *(p + i);
+  }
+  return s;
+}
+
+int main() {
+  int i;
+  int j;
+  int acc;
+  int last;
+  int *p;
+
+  calls = 0;
+  PRINT(fib(12));
+  PRINT(calls);
+
+  acc = 0;
+  last = 0;
+  for (i = 0; i < 5; i++) {
+    int k;
+    k = i * i;
+    for (j = 0; j < i; j++) {
+      acc += mix(i, j, k, last);
+      last = j;
+    }
+    table[i] = acc % 97;
+  }
+  PRINT(acc);
+  PRINT(last);
+  PRINT(table[1] + table[2] * 3 - table[4]);
+
+  p = (int *)MALLOC(sizeof(int) * 5);
+  i = 0;
+  while (i < 5) {
+    *(p + i) = table[i] - i;
+    i++;
+  }
+  PRINT(sum(p, 5));
+  FREE(p);
+  return 0;
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 
 #include "clang/AST/AST.h"
@@ -16,54 +19,374 @@
 #include "clang/Basic/SourceManager.h"
 #include "clang/Basic/TargetOptions.h"
 #include "clang/Basic/TargetInfo.h"
+#include "clang/Basic/Version.h"
+#include "clang/Lex/HeaderSearchOptions.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/PPCallbacks.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Parse/ParseAST.h"
 #include "clang/Rewrite/Frontend/Rewriters.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+#include "CompilerSession.h"
+#include "HeaderSearchCache.h"
 
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
 
-int main(int argc, char *argv[])
+enum class RawFormat { None, TSV, Binary };
+static llvm::cl::opt<RawFormat> rawFormat("raw",
+    llvm::cl::desc("Dump the tokens of the raw lexer (kind, offset, length) instead of preprocessing"),
+    llvm::cl::init(RawFormat::None),
+    llvm::cl::values(
+        clEnumValN(RawFormat::TSV, "tsv", "one tab-separated line per token"),
+        clEnumValN(RawFormat::Binary, "binary", "ULEB128 records, see dumpRawTokens")));
+static llvm::cl::opt<bool> summary("summary",
+    llvm::cl::desc("Preprocess the files in parallel and print one JSON line per file with its include graph, "
+                   "token count, include depth and time per header"));
+static llvm::cl::opt<unsigned> jobs("j", llvm::cl::desc("Number of files preprocessed at once by -summary, "
+                                                        "0 for all cores"), llvm::cl::init(0));
+static llvm::cl::list<std::string> includeDirs("I", llvm::cl::desc("Add a directory to the include path of -summary"),
+    llvm::cl::value_desc("dir"), llvm::cl::Prefix);
+static llvm::cl::list<std::string> inputFiles(llvm::cl::Positional, llvm::cl::desc("<input-file>..."),
+    llvm::cl::OneOrMore);
+
+static const unsigned rawBinaryVersion = 1;
+
+static void writeString(llvm::raw_ostream &out, llvm::StringRef s)
 {
-  if (argc != 2) {
-    llvm::errs() << "usage: " << argv[0] << " <input-file>\n";
-    return 1;
+  llvm::encodeULEB128(s.size(), out);
+  out << s;
+}
+
+// Dumps the tokens of one file as the raw lexer sees them, without preprocessing: directives and macro uses come out
+// as they are spelled, keywords and identifiers as raw_identifier. The file is memory mapped and the records go
+// through the buffered `out`, nothing is flushed per token.
+//
+// tsv:     "# <path>", then "<kind>\t<offset>\t<length>" per token
+// binary:  "CPPT", ULEB128 version, clang version (ULEB128 length + bytes) once, then per file its path
+//          (ULEB128 length + bytes) and per token: ULEB128 kind, ULEB128 gap since the end of the previous token,
+//          ULEB128 length. The eof token ends the file. Kinds are numbered as in the clang version of the header.
+static bool dumpRawTokens(const std::string &path, const LangOptions &langOpts, llvm::raw_ostream &out)
+{
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << path << ": " << buffer.getError().message() << "\n";
+    return false;
+  }
+
+  if (rawFormat == RawFormat::TSV) {
+    out << "# " << path << '\n';
+  } else {
+    writeString(out, path);
   }
 
-  CompilerInstance ci;
-  ci.createDiagnostics();                                    // create DiagnosticsEngine
-  
-  auto to = std::make_shared<TargetOptions>();
-  to->Triple = llvm::sys::getDefaultTargetTriple();
-  TargetInfo *targetInfo = TargetInfo::CreateTargetInfo(ci.getDiagnostics(), to);
-  ci.setTarget(targetInfo);
-
-  ci.createFileManager();                                    // create FileManager
-  ci.createSourceManager(ci.getFileManager());               // create SourceManager
-  ci.createPreprocessor(TU_Complete);                        // create Preprocessor
-     
-  llvm::ErrorOr<const clang::FileEntry*> pFile = ci.getFileManager().getFile(argv[1]);
-  SourceManager &SourceMgr = ci.getSourceManager();
-  SourceMgr.setMainFileID(SourceMgr.createFileID(pFile.get(), SourceLocation(), SrcMgr::C_User));
-
-  // ci.getSourceManager().createMainFileID(pFile.get());
-
-  ci.getPreprocessor().EnterMainSourceFile();
-  ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(), &ci.getPreprocessor());
+  const char *start = (*buffer)->getBufferStart();
+  Lexer lexer(SourceLocation(), langOpts, start, start, (*buffer)->getBufferEnd());
+  size_t end = 0;                                            // end of the previous token
   Token tok;
   do {
-      ci.getPreprocessor().Lex(tok);
-      if( ci.getDiagnostics().hasErrorOccurred()) {
-        break;
+    lexer.LexFromRawLexer(tok);
+    // the lexer stops right after the token it returns
+    size_t length = tok.getLength();
+    size_t offset = lexer.getBufferLocation() - start - length;
+    if (rawFormat == RawFormat::TSV) {
+      out << tok::getTokenName(tok.getKind()) << '\t' << offset << '\t' << length << '\n';
+    } else {
+      llvm::encodeULEB128(tok.getKind(), out);
+      llvm::encodeULEB128(offset - end, out);
+      llvm::encodeULEB128(length, out);
+    }
+    end = offset + length;
+  } while (tok.isNot(tok::eof));
+  return true;
+}
+
+// Follows the files the preprocessor enters and leaves. It records the include edges, the deepest nesting of open
+// files, and for each file its depth, the time from entering to leaving it (the headers it includes count too), and
+// the tokens lexed while it is the innermost open file.
+class IncludeRecorder : public PPCallbacks
+{
+public:
+  struct File {
+    std::string path;
+    size_t depth;
+    size_t tokens = 0;
+    std::chrono::steady_clock::duration time{};
+  };
+  struct Edge {
+    std::string from;
+    std::string to;                                          // as spelled when the include was not found
+    bool resolved;
+  };
+
+  explicit IncludeRecorder(SourceManager &sm) : sm_(sm) {}
+
+  void FileChanged(SourceLocation loc, FileChangeReason reason, SrcMgr::CharacteristicKind,
+                   FileID) override
+  {
+    if (reason == EnterFile) {
+      size_t index = noFile;
+      llvm::StringRef path = sm_.getFilename(loc);
+      if (!path.empty()) {                                   // the predefines buffer has no file and no depth
+        auto inserted = indices_.try_emplace(path, files_.size());
+        if (inserted.second) {
+          files_.push_back({path.str(), depth_});
+        }
+        index = inserted.first->second;
+        maxDepth_ = std::max(maxDepth_, depth_);
+        ++depth_;
       }
-        
-      ci.getPreprocessor().DumpToken(tok);
-      std::cerr << std::endl; 
-  } while (tok.isNot(clang::tok::eof));
+      stack_.push_back({index, std::chrono::steady_clock::now()});
+    } else if (reason == ExitFile && !stack_.empty()) {
+      leave();
+    }
+  }
+
+  void InclusionDirective(SourceLocation hashLoc, const Token &, llvm::StringRef fileName, bool, CharSourceRange,
+                          llvm::Optional<FileEntryRef> file, llvm::StringRef, llvm::StringRef, const Module *,
+                          SrcMgr::CharacteristicKind) override
+  {
+    edges_.push_back({sm_.getFilename(hashLoc).str(), file ? file->getName().str() : fileName.str(), bool(file)});
+  }
+
+  void countToken()
+  {
+    ++tokens_;
+    if (!stack_.empty() && stack_.back().file != noFile) {
+      ++files_[stack_.back().file].tokens;
+    }
+  }
+
+  // leaves the files still open, the main file at least
+  void finish()
+  {
+    while (!stack_.empty()) {
+      leave();
+    }
+  }
+
+  const std::vector<File> &files() const { return files_; }
+  const std::vector<Edge> &edges() const { return edges_; }
+  size_t tokens() const { return tokens_; }
+  size_t maxDepth() const { return maxDepth_; }
+
+private:
+  static const size_t noFile = ~size_t(0);
+
+  struct Open {
+    size_t file;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void leave()
+  {
+    if (stack_.back().file != noFile) {
+      files_[stack_.back().file].time += std::chrono::steady_clock::now() - stack_.back().start;
+      --depth_;
+    }
+    stack_.pop_back();
+  }
+
+  SourceManager &sm_;
+  llvm::StringMap<size_t> indices_;
+  std::vector<File> files_;
+  std::vector<Edge> edges_;
+  std::vector<Open> stack_;
+  size_t tokens_ = 0;
+  size_t depth_ = 0;                                         // real files open, so the main file has depth 0
+  size_t maxDepth_ = 0;
+};
+
+static double milliseconds(std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// C++17 unless the file is C, so that __cplusplus, __GNUC__ and the standard headers take the branches a build takes
+static void setLanguage(LangOptions &langOpts, llvm::StringRef path)
+{
+  bool cxx = llvm::sys::path::extension(path) != ".c";
+  langOpts.CPlusPlus = langOpts.CPlusPlus11 = langOpts.CPlusPlus14 = langOpts.CPlusPlus17 = cxx;
+  langOpts.Bool = cxx;
+  langOpts.C99 = langOpts.C11 = !cxx;
+  langOpts.LineComment = langOpts.Digraphs = true;
+  langOpts.GNUMode = true;
+  langOpts.GNUCVersion = 40201;
+}
+
+// Preprocesses one file and returns its summary as a line of JSON:
+// {"file", "tokens", "errors", "max_depth", "ms",
+//  "includes": [{"from", "to", "resolved"}], "files": [{"path", "depth", "tokens", "ms"}]}
+static std::string summarize(CompilerSession &session, const std::string &path, bool &opened)
+{
+  std::string line;
+  llvm::raw_string_ostream os(line);
+  llvm::json::OStream j(os);
 
-  ci.getDiagnosticClient().EndSourceFile();
+  setLanguage(session.getLangOpts(), path);
+  auto start = std::chrono::steady_clock::now();
+  opened = session.begin(path);
+  if (!opened) {
+    j.object([&] {
+      j.attribute("file", path);
+      j.attribute("error", "cannot open file");
+    });
+    os << '\n';
+    return os.str();
+  }
+
+  DiagnosticConsumer &diagnostics = *session.getDiagnostics().getClient();
+  diagnostics.clear();
+  Preprocessor &pp = session.getPreprocessor();
+  auto recorder = std::make_unique<IncludeRecorder>(session.getSourceManager());
+  IncludeRecorder &rec = *recorder;
+  pp.addPPCallbacks(std::move(recorder));
+  pp.EnterMainSourceFile();
+  Token tok;
+  for (pp.Lex(tok); tok.isNot(tok::eof); pp.Lex(tok)) {
+    rec.countToken();
+  }
+  rec.finish();
+  session.end();
+  auto time = std::chrono::steady_clock::now() - start;
+
+  j.object([&] {
+    j.attribute("file", path);
+    j.attribute("tokens", int64_t(rec.tokens()));
+    j.attribute("errors", int64_t(diagnostics.getNumErrors()));
+    j.attribute("max_depth", int64_t(rec.maxDepth()));
+    j.attribute("ms", milliseconds(time));
+    j.attributeArray("includes", [&] {
+      for (const IncludeRecorder::Edge &edge : rec.edges()) {
+        j.object([&] {
+          j.attribute("from", edge.from);
+          j.attribute("to", edge.to);
+          j.attribute("resolved", edge.resolved);
+        });
+      }
+    });
+    j.attributeArray("files", [&] {
+      for (const IncludeRecorder::File &file : rec.files()) {
+        j.object([&] {
+          j.attribute("path", file.path);
+          j.attribute("depth", int64_t(file.depth));
+          j.attribute("tokens", int64_t(file.tokens));
+          j.attribute("ms", milliseconds(file.time));
+        });
+      }
+    });
+  });
+  os << '\n';
+  return os.str();
+}
+
+// Each worker thread has a CompilerSession of its own and takes the next file until none is left. Diagnostics are
+// only counted, the summaries are printed in the order the files were given.
+static int runSummary()
+{
+  std::vector<std::string> systemDirs = hostIncludePaths();
+  if (systemDirs.empty()) {
+    systemDirs = {"/usr/local/include", "/usr/include"};
+  }
+
+  std::vector<std::string> results(inputFiles.size());
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  auto work = [&] {
+    CompilerSession session;
+    session.getDiagnostics().setClient(new DiagnosticConsumer(), /*ShouldOwnClient=*/true);
+    HeaderSearchOptions &hso = session.getHeaderSearchOpts();
+    for (const std::string &dir : includeDirs) {
+      hso.AddPath(dir, frontend::Angled, false, false);
+    }
+    for (const std::string &dir : systemDirs) {
+      hso.AddPath(dir, frontend::System, false, false);
+    }
+    for (size_t i = next++; i < inputFiles.size(); i = next++) {
+      bool opened;
+      results[i] = summarize(session, inputFiles[i], opened);
+      if (!opened) {
+        failed = true;
+      }
+    }
+  };
+
+  llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(jobs);
+  size_t workers = std::min<size_t>(strategy.compute_thread_count(), inputFiles.size());
+  llvm::ThreadPool pool(strategy);
+  for (size_t i = 0; i < workers; ++i) {
+    pool.async(work);
+  }
+  pool.wait();
+
+  for (const std::string &result : results) {
+    llvm::outs() << result;
+  }
+  llvm::outs().flush();
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  if (summary) {
+    return runSummary();
+  }
+
+  int status = 0;
+  if (rawFormat != RawFormat::None) {
+    // no CompilerInstance at all, only the language options the lexer needs, per file as for -summary
+    LangOptions langOpts;
+
+    llvm::raw_ostream &out = llvm::outs();
+    if (rawFormat == RawFormat::Binary) {
+      out << "CPPT";
+      llvm::encodeULEB128(rawBinaryVersion, out);
+      writeString(out, getClangFullVersion());
+    }
+    for (const std::string &path : inputFiles) {
+      setLanguage(langOpts, path);
+      if (!dumpRawTokens(path, langOpts, out)) {
+        status = 1;
+      }
+    }
+    out.flush();
+    return status;
+  }
+
+  // diagnostics, target and file manager are set up once for all the input files
+  CompilerSession session;
+
+  for (const std::string &path : inputFiles) {
+    if (!session.begin(path)) {                              // fresh SourceManager and Preprocessor
+      status = 1;
+      continue;
+    }
+
+    Preprocessor &pp = session.getPreprocessor();
+    pp.EnterMainSourceFile();
+    Token tok;
+    do {
+        pp.Lex(tok);
+        if( session.getDiagnostics().hasErrorOccurred()) {
+          break;
+        }
+
+        pp.DumpToken(tok);
+        std::cerr << std::endl; 
+    } while (tok.isNot(clang::tok::eof));
+
+    session.end();
+  }
 
-  return 0;
+  return status;
 }
\ No newline at end of file
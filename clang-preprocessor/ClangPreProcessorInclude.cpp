@@ -24,6 +24,9 @@
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Lex/PreprocessorOptions.h"
 
+#include "CompilerSession.h"
+#include "HeaderSearchCache.h"
+
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
@@ -31,58 +34,55 @@ using namespace clang::frontend;
 
 int main(int argc, char *argv[])
 {
-  if (argc != 2) {
-    llvm::errs() << "usage: " << argv[0] << " <input-file>\n";
+  if (argc < 2) {
+    llvm::errs() << "usage: " << argv[0] << " <input-file>...\n";
     return 1;
   }
 
-  // create a CompilerInstance and set the target platform to the host platform
-  CompilerInstance ci;
-  ci.createDiagnostics();                                    // create DiagnosticsEngine
-  
-  auto to = std::make_shared<TargetOptions>();
-  to->Triple = llvm::sys::getDefaultTargetTriple();
-  TargetInfo *targetInfo = TargetInfo::CreateTargetInfo(ci.getDiagnostics(), to);
-  ci.setTarget(targetInfo);
-  
-
-  // create a FileManager and a SourceManager
-  ci.createFileManager();                                    // create FileManager
-  ci.createSourceManager(ci.getFileManager());               // create SourceManager
+  // diagnostics, target (the host platform) and file manager are set up once for all the input files
+  CompilerSession session;
 
   // set up HeaderSearchOptions
-  HeaderSearchOptions &hso = ci.getHeaderSearchOpts();
+  HeaderSearchOptions &hso = session.getHeaderSearchOpts();
 
-  // add the system include path
-  hso.AddPath("/usr/include", System, false, false);
-  hso.AddPath("/usr/local/include", System, false, false);
-  hso.AddPath("/usr/local/lib/gcc/x86_64-pc-linux-gnu/7.5.0/include", System, false, false);
+  // add the system include paths of the host compiler, which is only queried again when it changes
+  std::vector<std::string> systemDirs = hostIncludePaths();
+  if (systemDirs.empty()) {
+    systemDirs = {"/usr/local/include", "/usr/include"};
+  }
+  for (const std::string &dir : systemDirs) {
+    hso.AddPath(dir, System, false, false);
+  }
 
   // add the current directory as a user include path
   hso.AddPath(".", Angled, false, false);
 
-  ci.createPreprocessor(TU_Complete);                        // create Preprocessor
-
-  llvm::ErrorOr<const clang::FileEntry*> pFile = ci.getFileManager().getFile(argv[1]);
-  SourceManager &SourceMgr = ci.getSourceManager();
-  SourceMgr.setMainFileID(SourceMgr.createFileID(pFile.get(), SourceLocation(), SrcMgr::C_User));
-
-  // ci.getSourceManager().createMainFileID(pFile.get());
-
-  ci.getPreprocessor().EnterMainSourceFile();
-  ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(), &ci.getPreprocessor());
-  Token tok;
-  do {
-      ci.getPreprocessor().Lex(tok);
-      if( ci.getDiagnostics().hasErrorOccurred()) {
-        break;
-      }
-
-      ci.getPreprocessor().DumpToken(tok);
-      std::cerr << std::endl; 
-  } while (tok.isNot(clang::tok::eof));
-
-  ci.getDiagnosticClient().EndSourceFile();
+  // include lookups that failed in earlier runs are not tried again while their directory is unchanged
+  session.getInstance().getFileManager().setStatCache(
+      std::make_unique<PersistentStatCache>(userCacheFile("missing-headers")));
+
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!session.begin(argv[i])) {                           // fresh SourceManager and Preprocessor
+      status = 1;
+      continue;
+    }
+
+    Preprocessor &pp = session.getPreprocessor();
+    pp.EnterMainSourceFile();
+    Token tok;
+    do {
+        pp.Lex(tok);
+        if( session.getDiagnostics().hasErrorOccurred()) {
+          break;
+        }
+
+        pp.DumpToken(tok);
+        std::cerr << std::endl; 
+    } while (tok.isNot(clang::tok::eof));
+
+    session.end();
+  }
 
-  return 0;
+  return status;
 }
\ No newline at end of file
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/LangOptions.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Basic/TargetInfo.h"
+#include "clang/Basic/TargetOptions.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendOptions.h"
+#include "clang/Lex/HeaderSearchOptions.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Serialization/ASTReader.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include "PchCache.h"
+
+/// Compiler state for the tools that drive a CompilerInstance by hand instead of
+/// through a ClangTool, so they can take any number of input files. The
+/// diagnostics, the target and the file manager are created once; tools set
+/// their language and header search options before the first file. Each file
+/// then only gets a fresh SourceManager, Preprocessor and, when it is parsed,
+/// ASTContext. The file manager, and with it every stat and directory lookup,
+/// is kept across files, so headers shared by the inputs are only looked up
+/// once.
+///
+/// With a PchCache, parsed files are compiled against a PCH of their #include
+/// block built with the session's own options; see setPchCache.
+///
+///   CompilerSession Session;
+///   for (const char *File : Files)
+///     if (Session.begin(File, /*Parse=*/true)) {
+///       ParseAST(Session.getPreprocessor(), &Consumer, Session.getASTContext());
+///       Session.end();
+///     }
+class CompilerSession {
+public:
+  CompilerSession() {
+    CI.createDiagnostics();
+    /// the triple is also kept in the invocation, which preamble PCHs are built from
+    CI.getTargetOpts().Triple = llvm::sys::getDefaultTargetTriple();
+    auto TO = std::make_shared<clang::TargetOptions>(CI.getTargetOpts());
+    CI.setTarget(clang::TargetInfo::CreateTargetInfo(CI.getDiagnostics(), TO));
+    CI.createFileManager();
+  }
+
+  ~CompilerSession() { end(); }
+
+  CompilerSession(const CompilerSession &) = delete;
+  CompilerSession &operator=(const CompilerSession &) = delete;
+
+  /// drops the state of the previous file and makes `Path` the main file, false
+  /// if it cannot be opened. `Parse` also creates an ASTContext.
+  bool begin(llvm::StringRef Path, bool Parse = false,
+             clang::TranslationUnitKind Kind = clang::TU_Complete) {
+    end();
+    llvm::ErrorOr<const clang::FileEntry *> File = CI.getFileManager().getFile(Path);
+    if (!File) {
+      llvm::errs() << Path << ": " << File.getError().message() << "\n";
+      return false;
+    }
+
+    PchCache::Entry Entry;
+    bool UsePch = Parse && Pch && prepare(Path, Entry);
+    /// a PCH that fails to load is dropped and the file parsed from scratch
+    Preamble = UsePch && open(*File, Parse, Kind, &Entry) ? Entry.Preamble : "";
+    if (Preamble.empty())
+      open(*File, Parse, Kind, nullptr);
+    CI.getDiagnosticClient().BeginSourceFile(CI.getLangOpts(), &CI.getPreprocessor());
+    InFile = true;
+    return true;
+  }
+
+  /// ends the current file, if any
+  void end() {
+    if (!InFile)
+      return;
+    CI.getDiagnosticClient().EndSourceFile();
+    InFile = false;
+  }
+
+  /// compiles the files parsed from now on against the preamble PCHs kept in
+  /// `Cache`. Set the language and header search options first, they are part
+  /// of the key of the PCHs.
+  void setPchCache(PchCache *Cache) { Pch = Cache; }
+
+  /// `Text`, the current main file as a tool prints it, with the preamble blanked
+  /// out for the PCH put back. Tools never rewrite the preamble, it holds nothing
+  /// but preprocessor directives.
+  std::string restorePreamble(llvm::StringRef Text) const {
+    return Preamble + Text.drop_front(Preamble.size()).str();
+  }
+
+  clang::CompilerInstance &getInstance() { return CI; }
+  clang::LangOptions &getLangOpts() { return CI.getLangOpts(); }
+  clang::HeaderSearchOptions &getHeaderSearchOpts() { return CI.getHeaderSearchOpts(); }
+  clang::DiagnosticsEngine &getDiagnostics() { return CI.getDiagnostics(); }
+  clang::SourceManager &getSourceManager() { return CI.getSourceManager(); }
+  clang::Preprocessor &getPreprocessor() { return CI.getPreprocessor(); }
+  clang::ASTContext &getASTContext() { return CI.getASTContext(); }
+
+private:
+  /// fresh source manager, preprocessor and, if `Parse`, AST context for `File`;
+  /// false if the PCH of `E` cannot be loaded
+  bool open(const clang::FileEntry *File, bool Parse, clang::TranslationUnitKind Kind,
+            const PchCache::Entry *E) {
+    /// the AST and the preprocessor refer to the source manager, they go first
+    CI.setASTReader(nullptr);
+    CI.setASTContext(nullptr);
+    CI.setPreprocessor(nullptr);
+    CI.getDiagnostics().Reset();
+    CI.getPreprocessorOpts().ImplicitPCHInclude = E ? E->PchPath : "";
+    CI.createSourceManager(CI.getFileManager());
+    clang::SourceManager &SM = CI.getSourceManager();
+    if (E)
+      SM.overrideFileContents(File, llvm::MemoryBuffer::getMemBufferCopy(E->MainContents, E->MainFile));
+    CI.createPreprocessor(Kind);
+    if (Parse)
+      CI.createASTContext();
+    SM.setMainFileID(SM.createFileID(File, clang::SourceLocation(), clang::SrcMgr::C_User));
+    if (!E)
+      return true;
+    CI.createPCHExternalASTSource(E->PchPath, clang::DisableValidationForModuleKind::None,
+                                  /*AllowPCHWithCompilerErrors=*/false,
+                                  /*DeserializationListener=*/nullptr,
+                                  /*OwnDeserializationListener=*/false);
+    return CI.getASTContext().getExternalSource() != nullptr;
+  }
+
+  bool prepare(llvm::StringRef Path, PchCache::Entry &E) {
+    llvm::SmallString<256> MainFile(Path);
+    llvm::sys::fs::make_absolute(MainFile);
+    return Pch->prepare(MainFile, config(), [&](const std::string &Header, const std::string &Output,
+                                               std::vector<std::string> &Deps) {
+      return build(MainFile, Header, Output, Deps);
+    }, E);
+  }
+
+  /// the options a preamble PCH depends on, as a key for the cache
+  std::string config() {
+    const clang::LangOptions &LangOpts = CI.getLangOpts();
+    std::string Blob = CI.getTargetOpts().Triple;
+#define LANGOPT(Name, Bits, Default, Description) \
+    Blob += ' ' + std::to_string(LangOpts.Name);
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description) \
+    Blob += ' ' + std::to_string(static_cast<unsigned>(LangOpts.get##Name()));
+#include "clang/Basic/LangOptions.def"
+    const clang::HeaderSearchOptions &HSOpts = CI.getHeaderSearchOpts();
+    Blob += '\0' + HSOpts.Sysroot + '\0' + HSOpts.ResourceDir + '\0' +
+            std::to_string(HSOpts.UseBuiltinIncludes) + std::to_string(HSOpts.UseStandardSystemIncludes) +
+            std::to_string(HSOpts.UseStandardCXXIncludes) + std::to_string(HSOpts.UseLibcxx);
+    for (const clang::HeaderSearchOptions::Entry &Dir : HSOpts.UserEntries)
+      Blob += '\0' + std::to_string(Dir.Group) + Dir.Path;
+    return Blob;
+  }
+
+  /// compiles the preamble `Header` of `MainFile` into the PCH `Output` with a
+  /// copy of the session's invocation
+  bool build(llvm::StringRef MainFile, const std::string &Header, const std::string &Output,
+             std::vector<std::string> &Deps) {
+    auto Invocation = std::make_shared<clang::CompilerInvocation>(CI.getInvocation());
+    Invocation->getPreprocessorOpts().ImplicitPCHInclude.clear();
+    /// quoted includes of the preamble resolve relative to the main file
+    Invocation->getHeaderSearchOpts().AddPath(llvm::sys::path::parent_path(MainFile), clang::frontend::Quoted,
+                                              /*IsFramework=*/false, /*IgnoreSysRoot=*/true);
+    clang::FrontendOptions &FrontendOpts = Invocation->getFrontendOpts();
+    clang::Language Lang = CI.getLangOpts().CPlusPlus ? clang::Language::CXX : clang::Language::C;
+    FrontendOpts.Inputs = {clang::FrontendInputFile(Header, clang::InputKind(Lang).getHeader())};
+    FrontendOpts.OutputFile = Output;
+    FrontendOpts.ProgramAction = clang::frontend::GeneratePCH;
+
+    clang::IgnoringDiagConsumer Ignore;
+    clang::CompilerInstance Builder;
+    Builder.setInvocation(std::move(Invocation));
+    Builder.createDiagnostics(&Ignore, /*ShouldOwnClient=*/false);
+    Builder.setFileManager(&CI.getFileManager());
+    Builder.createSourceManager(CI.getFileManager());
+    bool Ok = PchCache::generate(Builder, Deps);
+    for (std::string &Dep : Deps) {
+      llvm::SmallString<256> Abs(Dep);
+      llvm::sys::fs::make_absolute(Abs);
+      Dep = std::string(Abs);
+    }
+    return Ok;
+  }
+
+  clang::CompilerInstance CI;
+  PchCache *Pch = nullptr;
+  std::string Preamble;  /// blanked out in the current main file, empty without a PCH
+  bool InFile = false;
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "clang/Basic/FileSystemStatCache.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// path of `Name` in the per-user cache directory of these tools
+inline std::string userCacheFile(llvm::StringRef Name) {
+  llvm::SmallString<256> Path;
+  if (!llvm::sys::path::cache_directory(Path))
+    llvm::sys::path::system_temp_directory(/*ErasedOnReboot=*/false, Path);
+  llvm::sys::path::append(Path, "llvm-example");
+  llvm::sys::fs::create_directories(Path);
+  llvm::sys::path::append(Path, Name);
+  return std::string(Path);
+}
+
+/// The system include directories of the host C++ compiler, in search order, as
+/// printed by `<Compiler> -E -v -x c++ /dev/null`. The compiler is only run when
+/// its binary changed since the last query; the answer is kept in the user's
+/// cache directory. Empty when no compiler is found.
+inline std::vector<std::string> hostIncludePaths(llvm::StringRef Compiler = "c++") {
+  std::vector<std::string> Dirs;
+  llvm::ErrorOr<std::string> Program = llvm::sys::findProgramByName(Compiler);
+  llvm::SmallString<256> RealProgram;
+  llvm::sys::fs::file_status Status;
+  if (!Program || llvm::sys::fs::real_path(*Program, RealProgram) ||
+      llvm::sys::fs::status(RealProgram, Status))
+    return Dirs;
+
+  std::string Key = (llvm::Twine(*Program) + "\n" + RealProgram + "\n" + llvm::Twine(Status.getSize()) + "\n" +
+                     llvm::Twine(Status.getLastModificationTime().time_since_epoch().count())).str();
+  std::string CacheFile =
+      userCacheFile("host-includes-" + llvm::utohexstr(llvm::xxHash64(Key), /*LowerCase=*/true));
+  if (auto Cached = llvm::MemoryBuffer::getFile(CacheFile)) {
+    llvm::SmallVector<llvm::StringRef, 16> Lines;
+    (*Cached)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (llvm::StringRef Line : Lines)
+      Dirs.push_back(Line.str());
+    return Dirs;
+  }
+
+  llvm::SmallString<128> Output;
+  if (llvm::sys::fs::createTemporaryFile("host-includes", "txt", Output))
+    return Dirs;
+  llvm::FileRemover RemoveOutput(Output);
+  llvm::Optional<llvm::StringRef> Redirects[] = {llvm::StringRef(""), llvm::StringRef(""), llvm::StringRef(Output)};
+  if (llvm::sys::ExecuteAndWait(*Program, {*Program, "-E", "-v", "-x", "c++", "/dev/null"}, llvm::None, Redirects))
+    return Dirs;
+  auto Log = llvm::MemoryBuffer::getFile(Output);
+  if (!Log)
+    return Dirs;
+
+  llvm::SmallVector<llvm::StringRef, 64> Lines;
+  (*Log)->getBuffer().split(Lines, '\n');
+  bool InList = false;
+  for (llvm::StringRef Line : Lines) {
+    if (Line.startswith("#include <...> search starts here:")) {
+      InList = true;
+    } else if (Line.startswith("End of search list.")) {
+      break;
+    } else if (InList) {
+      Line = Line.trim();
+      Line.consume_back(" (framework directory)");
+      Dirs.push_back(Line.str());
+    }
+  }
+  if (!Dirs.empty()) {
+    std::string Text = llvm::join(Dirs, "\n") + "\n";
+    if (llvm::Error Err = llvm::writeFileAtomically(CacheFile + ".tmp-%%%%%%%%", CacheFile, Text))
+      llvm::consumeError(std::move(Err));
+  }
+  return Dirs;
+}
+
+/// Stat cache that remembers, across runs, the paths that did not exist. Header
+/// search probes every include directory in turn, so most of the stats of an
+/// include-heavy TU fail, and fail the same way every run. A remembered miss is
+/// trusted as long as its parent directory has the same mtime as when the miss
+/// was recorded (creating a file changes the mtime of its directory), and that
+/// mtime is read once per directory and run. Lookups that succeed always go to
+/// the file system.
+///
+/// Install with FileManager::setStatCache; the misses are written back to
+/// `Path`, one "<directory mtime> <TAB> <path>" line each, when the cache is
+/// destroyed with its file manager. Misses whose directory changed are dropped
+/// when the file is loaded, so it does not keep growing, and the write merges
+/// in the misses other processes recorded since the load.
+class PersistentStatCache : public clang::FileSystemStatCache {
+public:
+  explicit PersistentStatCache(std::string Path) : Path(std::move(Path)) {
+    read([&](llvm::StringRef File, int64_t Stamp) {
+      if (isCurrent(File, Stamp))
+        Missing[File] = Stamp;
+      else
+        Changed = true;
+    });
+  }
+
+  ~PersistentStatCache() override {
+    if (!Changed)
+      return;
+    /// other runs may have written the file since it was loaded
+    read([&](llvm::StringRef File, int64_t Stamp) {
+      if (!Missing.count(File) && isCurrent(File, Stamp))
+        Missing[File] = Stamp;
+    });
+    std::string Text;
+    llvm::raw_string_ostream OS(Text);
+    for (const auto &Entry : Missing)
+      OS << Entry.getValue() << '\t' << Entry.getKey() << '\n';
+    if (llvm::Error Err = llvm::writeFileAtomically(Path + ".tmp-%%%%%%%%", Path, OS.str()))
+      llvm::consumeError(std::move(Err));
+  }
+
+  std::error_code getStat(llvm::StringRef File, llvm::vfs::Status &Status, bool isFile,
+                          std::unique_ptr<llvm::vfs::File> *F, llvm::vfs::FileSystem &FS) override {
+    llvm::SmallString<256> Abs(File);
+    FS.makeAbsolute(Abs);
+    llvm::StringRef Dir = llvm::sys::path::parent_path(Abs);
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto It = Missing.find(Abs);
+      if (It != Missing.end()) {
+        if (It->getValue() == stamp(Dir, FS))
+          return std::make_error_code(std::errc::no_such_file_or_directory);
+        Missing.erase(It);
+        Changed = true;
+      }
+    }
+
+    std::error_code EC = get(File, Status, isFile, F, nullptr, FS);
+    if (EC == std::errc::no_such_file_or_directory) {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Missing[Abs] = stamp(Dir, FS);
+      Changed = true;
+    }
+    return EC;
+  }
+
+private:
+  /// calls `F` with the path and stamp of each line of the file at `Path`
+  template <typename Fn>
+  void read(Fn F) const {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return;
+    llvm::SmallVector<llvm::StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (llvm::StringRef Line : Lines) {
+      llvm::StringRef Stamp, File;
+      std::tie(Stamp, File) = Line.split('\t');
+      int64_t Value;
+      if (!File.empty() && !Stamp.getAsInteger(10, Value))
+        F(File, Value);
+    }
+  }
+
+  /// whether the directory of a recorded miss is unchanged
+  bool isCurrent(llvm::StringRef File, int64_t Stamp) {
+    return stamp(llvm::sys::path::parent_path(File), *llvm::vfs::getRealFileSystem()) == Stamp;
+  }
+
+  /// mtime of `Dir` in nanoseconds, -1 if it does not exist; read once per run
+  int64_t stamp(llvm::StringRef Dir, llvm::vfs::FileSystem &FS) {
+    auto It = Stamps.find(Dir);
+    if (It != Stamps.end())
+      return It->getValue();
+    llvm::ErrorOr<llvm::vfs::Status> DirStatus = FS.status(Dir);
+    int64_t Stamp = DirStatus ? std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    DirStatus->getLastModificationTime().time_since_epoch()).count()
+                              : -1;
+    Stamps[Dir] = Stamp;
+    return Stamp;
+  }
+
+  std::string Path;
+  std::mutex Mutex;
+  llvm::StringMap<int64_t> Missing;
+  llvm::StringMap<int64_t> Stamps;
+  bool Changed = false;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// On-disk record of what a tool produced for each TU, so that a rerun only
+/// processes the TUs that changed. A record is keyed by the TU's compile command
+/// and the tool's own options, and holds the content hash of every file the TU
+/// read (main file and transitive includes) next to the tool's output for it.
+/// A record is reused as long as all these files still hash the same. A file is
+/// hashed at most once per run, however many TUs include it.
+///
+/// The cache directory holds one <key>.tu file per TU:
+///
+///   deps <N>
+///   <hash> <TAB> <path>    N lines
+///   status <S>
+///   output <length>
+///   <output bytes>
+///   errors <length>
+///   <error bytes>
+class IncrementalCache {
+public:
+  /// what the tool produced for a TU
+  struct Record {
+    unsigned Status = 0;  /// tool-defined, e.g. whether the TU failed or its number of errors
+    std::string Output;
+    std::string Errors;
+  };
+
+  /// `Salt` holds whatever else changes the tool's output, e.g. its output format
+  IncrementalCache(std::string Dir, std::string Salt) : Dir(std::move(Dir)), Salt(std::move(Salt)) {
+    llvm::sys::fs::create_directories(this->Dir);
+  }
+
+  /// fills `R` with the record of `Cmd`'s TU if none of the files it read changed
+  bool lookup(const clang::tooling::CompileCommand &Cmd, Record &R) {
+    auto Buffer = llvm::MemoryBuffer::getFile(path(Cmd));
+    if (!Buffer || !parse((*Buffer)->getBuffer(), R)) {
+      ++NumRerun;
+      return false;
+    }
+    ++NumReused;
+    return true;
+  }
+
+  /// records `R` for `Cmd`'s TU, `Deps` being the files it read
+  void store(const clang::tooling::CompileCommand &Cmd, const std::vector<std::string> &Deps,
+             const Record &R) {
+    std::vector<std::string> Files{Cmd.Filename};
+    Files.insert(Files.end(), Deps.begin(), Deps.end());
+    std::string Text;
+    llvm::raw_string_ostream OS(Text);
+    OS << "deps " << Files.size() << '\n';
+    for (const std::string &File : Files) {
+      llvm::SmallString<256> Path(File);
+      llvm::sys::fs::make_absolute(Cmd.Directory, Path);
+      std::string Hash;
+      if (!hash(Path, Hash))
+        return;  /// a TU whose files cannot be read is simply run again next time
+      OS << Hash << '\t' << Path << '\n';
+    }
+    OS << "status " << R.Status << '\n';
+    OS << "output " << R.Output.size() << '\n' << R.Output;
+    OS << "errors " << R.Errors.size() << '\n' << R.Errors;
+    std::string Path = this->path(Cmd);
+    if (llvm::Error Err = llvm::writeFileAtomically(Path + ".tmp-%%%%%%%%", Path, OS.str()))
+      llvm::consumeError(std::move(Err));
+  }
+
+  /// wraps `Action` so that the files its TU reads are appended to `Deps`
+  static std::unique_ptr<clang::FrontendAction> recordDependencies(std::unique_ptr<clang::FrontendAction> Action,
+                                                                   std::vector<std::string> &Deps) {
+    return std::make_unique<RecordingAction>(std::move(Action), Deps);
+  }
+
+  void printStats(llvm::raw_ostream &OS) const {
+    OS << "incremental: " << NumReused << " TUs reused, " << NumRerun << " rerun\n";
+  }
+
+private:
+  class AllDependencies : public clang::DependencyCollector {
+  public:
+    bool needSystemDependencies() override { return true; }
+  };
+
+  class RecordingAction : public clang::WrapperFrontendAction {
+  public:
+    RecordingAction(std::unique_ptr<clang::FrontendAction> Action, std::vector<std::string> &Deps)
+        : WrapperFrontendAction(std::move(Action)), Deps(Deps), Collector(std::make_shared<AllDependencies>()) {}
+
+  protected:
+    /// called before the preprocessor and the PCH reader, which the collector hooks into, are created
+    bool BeginInvocation(clang::CompilerInstance &CI) override {
+      CI.addDependencyCollector(Collector);
+      return WrapperFrontendAction::BeginInvocation(CI);
+    }
+
+    void EndSourceFileAction() override {
+      WrapperFrontendAction::EndSourceFileAction();
+      for (const std::string &Dep : Collector->getDependencies())
+        Deps.push_back(Dep);
+    }
+
+  private:
+    std::vector<std::string> &Deps;
+    std::shared_ptr<AllDependencies> Collector;
+  };
+
+  std::string path(const clang::tooling::CompileCommand &Cmd) const {
+    std::string Blob = clang::getClangFullVersion();
+    for (const std::string *Part : {&Salt, &Cmd.Directory, &Cmd.Filename}) {
+      Blob += '\0';
+      Blob += *Part;
+    }
+    for (const std::string &Arg : Cmd.CommandLine) {
+      Blob += '\0';
+      Blob += Arg;
+    }
+    return Dir + "/" + llvm::utohexstr(llvm::xxHash64(Blob), /*LowerCase=*/true) + ".tu";
+  }
+
+  /// content hash of `Path`, computed once per run
+  bool hash(llvm::StringRef Path, std::string &Hash) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto It = Hashes.find(Path);
+      if (It != Hashes.end()) {
+        Hash = It->second;
+        return !Hash.empty();
+      }
+    }
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    Hash = Buffer ? llvm::utohexstr(llvm::xxHash64((*Buffer)->getBuffer()), /*LowerCase=*/true) : "";
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Hashes[Path] = Hash;
+    return !Hash.empty();
+  }
+
+  /// reads a record, false if it is malformed or one of its files changed
+  bool parse(llvm::StringRef Text, Record &R) {
+    auto Field = [&Text](llvm::StringRef Name, size_t &Value) {
+      llvm::StringRef Line;
+      std::tie(Line, Text) = Text.split('\n');
+      return Line.consume_front(Name) && Line.consume_front(" ") && !Line.getAsInteger(10, Value);
+    };
+    auto Bytes = [&](llvm::StringRef Name, std::string &Value) {
+      size_t Size;
+      if (!Field(Name, Size) || Size > Text.size())
+        return false;
+      Value = Text.take_front(Size).str();
+      Text = Text.drop_front(Size);
+      return true;
+    };
+
+    size_t NumDeps;
+    if (!Field("deps", NumDeps))
+      return false;
+    for (size_t I = 0; I < NumDeps; ++I) {
+      llvm::StringRef Line, Hash, Path;
+      std::tie(Line, Text) = Text.split('\n');
+      std::tie(Hash, Path) = Line.split('\t');
+      std::string Current;
+      if (Path.empty() || !hash(Path, Current) || Current != Hash)
+        return false;
+    }
+    size_t Status;
+    if (!Field("status", Status))
+      return false;
+    R.Status = Status;
+    return Bytes("output", R.Output) && Bytes("errors", R.Errors);
+  }
+
+  std::string Dir;
+  std::string Salt;
+  std::mutex Mutex;
+  llvm::StringMap<std::string> Hashes;
+  std::atomic<unsigned> NumReused{0};
+  std::atomic<unsigned> NumRerun{0};
+};
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// On-disk cache of precompiled preambles, shared by the tools that run through
+/// a ClangTool and, through CompilerSession, by those that set up their compiler
+/// by hand. The preamble of a TU is the block of preprocessor directives at
+/// the top of its main file, in practice its #includes. It is compiled once into
+/// a PCH, and every later TU with the same preamble text, directory and compile
+/// flags loads that PCH instead of parsing its headers again. The main file is
+/// then compiled with its preamble blanked out, line and column numbers stay the
+/// same.
+///
+/// An entry <key> of the cache directory is made of
+///
+///   <key>.h     the preamble, compiled as a header with the TU's flags
+///   <key>.pch   the PCH
+///   <key>.deps  one "size <TAB> mtime <TAB> path" line per file the PCH read
+///   <key>.fail  instead of .deps when the preamble failed to compile, same format
+///
+/// The .deps sidecar is written last and is checked against the file system on
+/// every lookup; an entry whose headers changed is rebuilt. A fresh .fail makes
+/// the TU skip the cache without trying the build again. Entries are published
+/// by renaming, so tools running concurrently on the same cache only ever see
+/// complete entries. When a preamble cannot be precompiled on its own, e.g. it
+/// ends inside an #if, the TU simply runs without the cache.
+///
+/// Declarations loaded from the PCH are not handed to HandleTopLevelDecl, so the
+/// cache only suits tools whose output covers the main file; clang-declname,
+/// which prints the variables of the headers too, does not use it.
+class PchCache {
+public:
+  /// What a TU needs to be compiled against its cached preamble
+  struct Entry {
+    std::string PchPath;
+    std::string MainFile;      /// absolute path of the main file
+    std::string MainContents;  /// the main file with its preamble blanked out
+    std::string Preamble;      /// the text blanked out at the start of MainContents
+  };
+
+  explicit PchCache(std::string Dir) : Dir(std::move(Dir)) {
+    llvm::sys::fs::create_directories(this->Dir);
+  }
+
+  /// builds the PCH of `Header` into `Pch` and lists the files it read, with absolute
+  /// paths, whether or not the build succeeds
+  using Builder = llvm::function_ref<bool(const std::string &Header, const std::string &Pch,
+                                          std::vector<std::string> &Deps)>;
+
+  /// finds or builds the PCH of the preamble of `Cmd`'s file, false if the TU
+  /// should run without it
+  bool prepare(const clang::tooling::CompileCommand &Cmd, Entry &E) {
+    llvm::SmallString<256> MainFile(Cmd.Filename);
+    llvm::sys::fs::make_absolute(Cmd.Directory, MainFile);
+    std::vector<std::string> Args = flags(Cmd);
+    std::string Config = Cmd.Directory;
+    for (const std::string &Arg : Args) {
+      Config += '\0';
+      Config += Arg;
+    }
+    return prepare(MainFile, Config, [&](const std::string &Header, const std::string &Pch,
+                                         std::vector<std::string> &Deps) {
+      return build(Cmd, Args, MainFile, Header, Pch, Deps);
+    }, E);
+  }
+
+  /// the same for a compiler set up by hand rather than from a compile command;
+  /// `Config` stands for its options and `Build` compiles a preamble with them
+  bool prepare(llvm::StringRef MainFile, llvm::StringRef Config, Builder Build, Entry &E) {
+    auto Buffer = llvm::MemoryBuffer::getFile(MainFile);
+    if (!Buffer) {
+      ++NumUncached;
+      return false;
+    }
+    llvm::StringRef Contents = (*Buffer)->getBuffer();
+    clang::LangOptions LangOpts;
+    LangOpts.CPlusPlus = true;
+    clang::PreambleBounds Bounds = clang::Lexer::ComputePreamble(Contents, LangOpts);
+    llvm::StringRef Preamble = Contents.take_front(Bounds.Size);
+    if (!Preamble.contains("#include") && !Preamble.contains("#import")) {
+      ++NumUncached;
+      return false;
+    }
+
+    std::string Key = key(Preamble, llvm::sys::path::parent_path(MainFile), Config);
+    std::string Base = (llvm::Twine(Dir) + "/" + Key).str();
+    E.PchPath = Base + ".pch";
+
+    if (isFresh(Base + ".deps")) {
+      ++NumHits;
+    } else if (isFresh(Base + ".fail")) {
+      ++NumKnownFailures;
+      return false;
+    } else {
+      std::string Header = Base + ".h";
+      std::string Text = Preamble.str();
+      if (!Bounds.PreambleEndsAtStartOfLine)
+        Text += "\n";
+      /// a PCH records the mtime of its header, so an unchanged header is left alone
+      auto Existing = llvm::MemoryBuffer::getFile(Header);
+      bool HaveHeader = Existing && (*Existing)->getBuffer() == Text;
+      if (!HaveHeader && !publish(Header, Text)) {
+        ++NumFailed;
+        return false;
+      }
+      std::vector<std::string> Deps;
+      if (!Build(Header, E.PchPath, Deps)) {
+        /// the same preamble fails the same way until one of the files it read
+        /// changes; a build that read nothing failed for some other reason
+        llvm::sys::fs::remove(Base + ".deps");
+        if (!Deps.empty())
+          writeDeps(Base + ".fail", Deps);
+        ++NumFailed;
+        return false;
+      }
+      if (!writeDeps(Base + ".deps", Deps)) {
+        ++NumFailed;
+        return false;
+      }
+      llvm::sys::fs::remove(Base + ".fail");
+      ++NumMisses;
+    }
+
+    E.MainFile = MainFile.str();
+    E.MainContents = Contents.str();
+    E.Preamble = Preamble.str();
+    for (size_t I = 0; I < Bounds.Size; ++I)
+      if (E.MainContents[I] != '\n')
+        E.MainContents[I] = ' ';
+    return true;
+  }
+
+  /// makes `Tool`, which runs exactly the TU of `E`, use the cached preamble
+  static void apply(clang::tooling::ClangTool &Tool, const Entry &E) {
+    Tool.mapVirtualFile(E.MainFile, E.MainContents);
+    Tool.appendArgumentsAdjuster(clang::tooling::getInsertArgumentAdjuster(
+        {"-include-pch", E.PchPath}, clang::tooling::ArgumentInsertPosition::BEGIN));
+  }
+
+  /// runs `CI`, whose invocation names the preamble header as input and the PCH
+  /// as output, and lists the files the PCH read
+  static bool generate(clang::CompilerInstance &CI, std::vector<std::string> &Deps) {
+    auto Collector = std::make_shared<AllDependencies>();
+    CI.addDependencyCollector(Collector);
+    clang::GeneratePCHAction Action;
+    bool Ok = CI.ExecuteAction(Action) && !CI.getDiagnostics().hasErrorOccurred();
+    Deps = Collector->getDependencies().vec();
+    return Ok;
+  }
+
+  void printStats(llvm::raw_ostream &OS) const {
+    OS << "pch cache: " << NumHits << " hits, " << NumMisses << " misses, "
+       << NumStale << " stale, " << NumFailed << " failed builds, "
+       << NumKnownFailures << " skipped known failures, "
+       << NumUncached << " TUs without a preamble\n";
+  }
+
+private:
+  /// records every file the PCH read, system headers included
+  class AllDependencies : public clang::DependencyCollector {
+  public:
+    bool needSystemDependencies() override { return true; }
+  };
+
+  class BuildAction : public clang::tooling::ToolAction {
+  public:
+    explicit BuildAction(std::string Output) : Output(std::move(Output)) {}
+
+    bool runInvocation(std::shared_ptr<clang::CompilerInvocation> Invocation,
+                       clang::FileManager *Files,
+                       std::shared_ptr<clang::PCHContainerOperations> PCHOps,
+                       clang::DiagnosticConsumer *Diags) override {
+      Invocation->getFrontendOpts().OutputFile = Output;
+      Invocation->getFrontendOpts().ProgramAction = clang::frontend::GeneratePCH;
+      clang::CompilerInstance CI(std::move(PCHOps));
+      CI.setInvocation(std::move(Invocation));
+      CI.setFileManager(Files);
+      CI.createDiagnostics(Diags, /*ShouldOwnClient=*/false);
+      CI.createSourceManager(*Files);
+      return generate(CI, Deps);
+    }
+
+    std::string Output;
+    std::vector<std::string> Deps;
+  };
+
+  /// the compile flags of `Cmd`, without its input and output
+  static std::vector<std::string> flags(const clang::tooling::CompileCommand &Cmd) {
+    std::vector<std::string> Args = clang::tooling::getClangStripOutputAdjuster()(
+        Cmd.CommandLine, Cmd.Filename);
+    Args = clang::tooling::getClangStripDependencyFileAdjuster()(Args, Cmd.Filename);
+    llvm::erase_if(Args, [&](const std::string &Arg) {
+      return Arg == Cmd.Filename || Arg == "-c";
+    });
+    return Args;
+  }
+
+  static std::string key(llvm::StringRef Preamble, llvm::StringRef MainDir, llvm::StringRef Config) {
+    std::string Blob = clang::getClangFullVersion();
+    for (llvm::StringRef Part : {MainDir, Config, Preamble}) {
+      Blob += '\0';
+      Blob += Part.str();
+    }
+    return llvm::utohexstr(llvm::xxHash64(Blob), /*LowerCase=*/true);
+  }
+
+  /// whether the entry exists and none of the files its PCH read has changed
+  bool isFresh(const std::string &DepsPath) {
+    auto Deps = llvm::MemoryBuffer::getFile(DepsPath);
+    if (!Deps)
+      return false;
+    llvm::SmallVector<llvm::StringRef, 64> Lines;
+    (*Deps)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (llvm::StringRef Line : Lines) {
+      llvm::StringRef Size, MTime, Path;
+      std::tie(Size, Line) = Line.split('\t');
+      std::tie(MTime, Path) = Line.split('\t');
+      llvm::sys::fs::file_status Status;
+      if (llvm::sys::fs::status(Path, Status) || Size != std::to_string(Status.getSize()) ||
+          MTime != std::to_string(llvm::sys::toTimeT(Status.getLastModificationTime()))) {
+        ++NumStale;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool build(const clang::tooling::CompileCommand &Cmd, std::vector<std::string> Args,
+             llvm::StringRef MainFile, const std::string &Header, const std::string &Pch,
+             std::vector<std::string> &Deps) {
+    /// quoted includes of the preamble resolve relative to the main file
+    Args.insert(Args.end(), {"-fsyntax-only", "-iquote", llvm::sys::path::parent_path(MainFile).str(),
+                             "-x", isC(MainFile) ? "c-header" : "c++-header", Header});
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS = llvm::vfs::createPhysicalFileSystem();
+    FS->setCurrentWorkingDirectory(Cmd.Directory);
+    llvm::IntrusiveRefCntPtr<clang::FileManager> Files(
+        new clang::FileManager(clang::FileSystemOptions(), FS));
+    BuildAction Action(Pch);
+    clang::tooling::ToolInvocation Invocation(Args, &Action, Files.get());
+    clang::IgnoringDiagConsumer Ignore;
+    Invocation.setDiagnosticConsumer(&Ignore);
+    bool Ok = Invocation.run();
+    for (const std::string &Dep : Action.Deps) {
+      llvm::SmallString<256> Path(Dep);
+      FS->makeAbsolute(Path);
+      Deps.push_back(std::string(Path));
+    }
+    return Ok;
+  }
+
+  /// writes the .deps sidecar of an entry whose PCH read `Deps`
+  static bool writeDeps(const std::string &Path, const std::vector<std::string> &Deps) {
+    std::string Text;
+    llvm::raw_string_ostream OS(Text);
+    for (const std::string &Dep : Deps) {
+      llvm::sys::fs::file_status Status;
+      if (llvm::sys::fs::status(Dep, Status))
+        return false;
+      OS << Status.getSize() << '\t' << llvm::sys::toTimeT(Status.getLastModificationTime())
+         << '\t' << Dep << '\n';
+    }
+    return publish(Path, OS.str());
+  }
+
+  static bool isC(llvm::StringRef File) {
+    return llvm::sys::path::extension(File) == ".c";
+  }
+
+  /// writes `Path` through a unique temporary and a rename
+  static bool publish(const std::string &Path, llvm::StringRef Contents) {
+    int FD;
+    llvm::SmallString<256> Tmp;
+    if (llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%%%", FD, Tmp))
+      return false;
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Contents;
+      if (OS.has_error()) {
+        OS.clear_error();
+        llvm::sys::fs::remove(Tmp);
+        return false;
+      }
+    }
+    return !llvm::sys::fs::rename(Tmp, Path);
+  }
+
+  std::string Dir;
+  std::atomic<unsigned> NumHits{0};
+  std::atomic<unsigned> NumMisses{0};
+  std::atomic<unsigned> NumStale{0};
+  std::atomic<unsigned> NumFailed{0};
+  std::atomic<unsigned> NumKnownFailures{0};
+  std::atomic<unsigned> NumUncached{0};
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/DeclGroup.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+/// Decides which top-level declarations an AST tool descends into, so that the
+/// declarations pulled in from headers are pruned before their subtrees are
+/// walked rather than filtered while printing.
+///
+/// By default only declarations spelled in the main file are traversed. Path
+/// prefixes add the files under them, e.g. the headers of the project itself.
+/// Declarations without a location, the implicit ones of the TU, are skipped.
+/// The decision is cached per file, so the cost per declaration is one lookup.
+class TraversalPolicy {
+public:
+  explicit TraversalPolicy(const clang::SourceManager &SM,
+                           const std::vector<std::string> &Prefixes = {})
+      : SM(SM) {
+    for (const std::string &Prefix : Prefixes) {
+      llvm::SmallString<256> Abs(Prefix);
+      llvm::sys::fs::make_absolute(Abs);
+      llvm::sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+      this->Prefixes.push_back(std::string(Abs));
+    }
+  }
+
+  bool shouldTraverse(const clang::Decl *D) const {
+    clang::SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+    if (Loc.isInvalid())
+      return false;
+    clang::FileID FID = SM.getFileID(Loc);
+    auto It = Cache.find(FID);
+    if (It != Cache.end())
+      return It->second;
+    return Cache[FID] = shouldTraverse(FID);
+  }
+
+  /// traverses the declarations of a group the policy accepts, for HandleTopLevelDecl
+  template <typename Visitor>
+  void traverse(Visitor &V, clang::DeclGroupRef DR) const {
+    for (clang::Decl *D : DR)
+      if (shouldTraverse(D))
+        V.TraverseDecl(D);
+  }
+
+  /// traverses the top-level declarations of a TU the policy accepts, in place
+  /// of traversing the TranslationUnitDecl itself
+  template <typename Visitor>
+  void traverse(Visitor &V, clang::ASTContext &Context) const {
+    for (clang::Decl *D : Context.getTranslationUnitDecl()->decls())
+      if (shouldTraverse(D))
+        V.TraverseDecl(D);
+  }
+
+private:
+  bool shouldTraverse(clang::FileID FID) const {
+    if (FID == SM.getMainFileID())
+      return true;
+    if (Prefixes.empty())
+      return false;
+    const clang::FileEntry *File = SM.getFileEntryForID(FID);
+    if (!File)
+      return false;
+    llvm::StringRef Path = File->tryGetRealPathName();
+    if (Path.empty())
+      Path = File->getName();
+    for (const std::string &Prefix : Prefixes)
+      if (Path.startswith(Prefix))
+        return true;
+    return false;
+  }
+
+  const clang::SourceManager &SM;
+  std::vector<std::string> Prefixes;
+  mutable llvm::DenseMap<clang::FileID, bool> Cache;
+};